@@ -40,24 +40,86 @@
 #include <sched.h>
 #include <stdint.h>
 #include <time.h>
-#include <speex/speex_echo.h>
-#include <speex/speex_preprocess.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "audio-daemon.h"
 #include "mb.h"
+#include "sgcopy.h"
+#include "mix.h"
+#include "cmdq.h"
+#include "resample.h"
+#include "dsp.h"
 
 int period_size;
+int alsa_rate = HW_SAMPLE_RATE;
+int resample_quality = RESAMPLE_QUALITY_DEFAULT;
+int dsp_stages = DSP_ALL;
+int low_latency;
 static snd_output_t *output = NULL;
 //static char *device = "hw:0,0";
 static char *device = "asym0";
 
 static int do_playback_work(struct alsa_stream *as);
 static int do_capture_work(struct alsa_stream *as);
+static void set_level(int level);
 
-int playback_is_running = 0;
-int capture_is_running = 0;
-SpeexEchoState *echo_state;
-SpeexPreprocessState *preprocess_state;
+/*
+ * The card's period, and periods in its buffer, from the smallest. The
+ * normal mode stays on the last, low latency mode starts on the first.
+ * One period less than the buffer is primed with silence.
+ */
+static const struct {
+    int period;
+    int periods;
+} levels[] = {
+    { 128, 3 },
+    { 256, 3 },
+    { 256, 4 },
+    { 512, 4 },
+    { PERIOD_FRAMES, BUFFER_FRAMES / PERIOD_FRAMES },
+};
+#define N_LEVELS (sizeof (levels) / sizeof (levels[0]))
+
+/*
+ * The host sound card, shared by all the guests. The audio thread mixes
+ * the playback streams of the guests into one, and hands what is
+ * captured to each of them. The list of guests is only changed by the
+ * main thread, under lock, which the audio thread holds while it works
+ * on the guests. The state of the guest streams is the audio thread's
+ * alone, the guest commands get to it through each guest's cmdq, with a
+ * byte on the wake pipe to have them carried out at once.
+ */
+struct audio_hw {
+    snd_pcm_t *p_handle;
+    snd_pcm_t *c_handle;
+    int rate;                   /* as set, alsa_rate when the card has it */
+    int users;
+    int primed;
+    int aec;                    /* a guest had echo cancelling last period */
+
+    int level;                  /* in levels[] */
+    int period;                 /* frames */
+    int buffer;
+    /* Low latency mode, see note_xrun() */
+    int xruns;
+    uint64_t last_xrun;         /* ms */
+    uint64_t last_change;
+    int shrink_after;
+    int shrunk;
+
+    pthread_mutex_t lock;
+    struct xen_vsnd_backend *guests;
+
+    pthread_t thread;
+    int wake[2];
+    int stopping;
+};
+
+static struct audio_hw hw = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
 		     uint64_t s_time, int status)
@@ -70,9 +132,10 @@ void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
     be_info->status = status;
 
     wmb();
+    store_release(&as->status, status);
 }
 
-void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
+void alsa_refresh_be_playback_info(struct alsa_stream *as, int frames)
 {
     uint64_t time_nsec;
     snd_pcm_sframes_t delay;
@@ -81,10 +144,10 @@ void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
     time_nsec = get_nsec_now();
 
     pointer = as->hw_ptr/4;
-    pointer -= (1024 * periods);
+    pointer -= frames;
     if (pointer < 0)
-	pointer += (N_AUD_BUFFER_PAGES * 1024);
-    pointer %= (N_AUD_BUFFER_PAGES * 1024);
+	pointer += as->buffer_bytes/4;
+    pointer %= as->buffer_bytes/4;
 
     refresh_be_info(as, pointer, 0, time_nsec, STREAM_STARTED);
 }
@@ -100,57 +163,24 @@ void alsa_refresh_be_capture_info(struct alsa_stream *as)
 
 static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as)
 {
-    int16_t *src;
-    int val, vol;
-
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
-
-    size = size / 2;
-   
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*dst++ = (*src) * val / 100;
-
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
-	}
-    }
-    return;   
+    sg_read(dst, as->dma_buffer, as->buffer_bytes, &as->hw_ptr, size,
+	    PCM_GAIN_UNITY);
+    as->processed += size;
 }
 
-static void put_data_to_sg(int16_t *dst, int size, struct alsa_stream *as)
+static void put_data_to_sg(int16_t *src, int size, struct alsa_stream *as)
 {
-    int16_t *src;
-    int val, vol;
-
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
-
-    size = size / 2;
-
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*src = (*dst++) * val / 100;
-
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
-	}
-    }
-    return;    
+    sg_write(as->dma_buffer, as->buffer_bytes, &as->hw_ptr, src, size,
+	     PCM_GAIN_UNITY);
+    as->processed += size;
 }
 
 static int set_hwparams(snd_pcm_t *handle,
 			snd_pcm_hw_params_t *params,
 			snd_pcm_access_t access,
 			int period_frames,
-			int buffer_frames)
+			int buffer_frames,
+			unsigned int *rate)
 {
     unsigned int rrate;
     snd_pcm_uframes_t size;
@@ -162,7 +192,7 @@ static int set_hwparams(snd_pcm_t *handle,
 	printf("Broken configuration for playback: no configurations available: %s\n", snd_strerror(err));
 	return err;
     }
-    /* set hardware resampling */
+    /* no resampling in ALSA, the card runs at a rate it has */
     err = snd_pcm_hw_params_set_rate_resample(handle, params, 0);
     if (err < 0) {
 	printf("Resampling setup failed for playback: %s\n", snd_strerror(err));
@@ -186,17 +216,16 @@ static int set_hwparams(snd_pcm_t *handle,
 	printf("Channels count (%i) not available for playbacks: %s\n", 2, snd_strerror(err));
 	return err;
     }
-    /* set the stream rate */
-    rrate = SAMPLE_RATE;
+    /* set the stream rate, the nearest the card has */
+    rrate = *rate;
     err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
     if (err < 0) {
-	printf("Rate %iHz not available for playback: %s\n", SAMPLE_RATE, snd_strerror(err));
+	printf("Rate %uHz not available for playback: %s\n", *rate, snd_strerror(err));
 	return err;
     }
-    if (rrate != SAMPLE_RATE) {
-	printf("Rate doesn't match (requested %iHz, get %iHz)\n", SAMPLE_RATE, err);
-	return -EINVAL;
-    }
+    if (rrate != *rate)
+	printf("Rate doesn't match (requested %uHz, get %uHz)\n", *rate, rrate);
+    *rate = rrate;
     err = snd_pcm_hw_params_set_buffer_size(handle, params, buffer_frames);
     if (err < 0) {
 	printf("Unable to set buffer time %i for playback: %s\n", 2048, snd_strerror(err));
@@ -283,16 +312,6 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
     return err;
 }
 
-static int alsa_prepare(struct alsa_stream *as)
-{
-    pthread_mutex_lock(&as->mutex);   
-    snd_pcm_prepare(as->handle);
-    as->hw_ptr = as->processed = as->processed_periods = 0;
-    pthread_mutex_unlock(&as->mutex);   
-    return 0;
-}
-
-
 int alsa_get_live_frames(struct alsa_stream *as)
 {
     int app_ptr, pv_avail;
@@ -307,308 +326,761 @@ int alsa_get_live_frames(struct alsa_stream *as)
 }
 
 char null_buffer[4096] = {0};
-char prev_buf_1[4096] = {0};
-char prev_buf_2[4096] = {0};
-char mono_input[4096] = {0};
 
-static void fill_averege(int16_t *src, int16_t *dst)
+static uint64_t now_ms(void)
 {
-    int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i/2] = (src[i] + src[i+1])/2;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * In low latency mode, a few xruns close together move the card to the
+ * next level up. Failing again soon after shrinking makes the next
+ * shrink wait twice as long, so it settles on what the system can do.
+ * Returns 1 if the card moved.
+ */
+static int note_xrun(void)
+{
+    uint64_t now = now_ms();
+
+    if (!low_latency)
+	return 0;
+
+    if (hw.xruns && now - hw.last_xrun > XRUN_WINDOW_MS)
+	hw.xruns = 0;
+    hw.xruns++;
+    hw.last_xrun = now;
+    if (hw.xruns < XRUNS_TO_GROW || hw.level == N_LEVELS - 1)
+	return 0;
+
+    if (hw.shrunk && now - hw.last_change < hw.shrink_after &&
+	hw.shrink_after < SHRINK_AFTER_MAX_MS)
+	hw.shrink_after *= 2;
+    hw.shrunk = 0;
+    hw.xruns = 0;
+    set_level(hw.level + 1);
+
+    return 1;
+}
+
+/* And back down a level after long enough without xruns */
+static void maybe_shrink(void)
+{
+    uint64_t now;
+
+    if (!low_latency || !hw.level)
+	return;
+
+    now = now_ms();
+    if (now - hw.last_change < hw.shrink_after ||
+	now - hw.last_xrun < hw.shrink_after)
+	return;
+
+    hw.shrunk = 1;
+    set_level(hw.level - 1);
+}
+
+static void alsa_repare(void)
+{
+    if (note_xrun())
+	return;
+
+    snd_pcm_drop(hw.p_handle);
+    snd_pcm_drop(hw.c_handle);
+    snd_pcm_resume(hw.p_handle);
+    snd_pcm_resume(hw.c_handle);
+    snd_pcm_prepare(hw.p_handle);
+    snd_pcm_prepare(hw.c_handle);
+    hw.primed = 0;
+    snd_pcm_start(hw.c_handle);
+}
+
+static void drift_reset(struct alsa_stream *as)
+{
+    memset(&as->drift, 0, sizeof (as->drift));
+    if (as->rs)
+	resampler_adjust(as->rs, 0);
+}
+
+/*
+ * Once per period consumed, with the guest frames left waiting. The
+ * level they settle at once started becomes the target, the resampler
+ * is then steered to keep them there.
+ */
+static void drift_update(struct alsa_stream *as, int fill, int need)
+{
+    struct drift *d = &as->drift;
+    double err, adjust;
+
+    if (!d->periods++)
+	d->fill = fill;
+    else
+	d->fill += (fill - d->fill) * DRIFT_FILTER;
+
+    if (d->periods < DRIFT_SETTLE_PERIODS)
+	return;
+    if (d->periods == DRIFT_SETTLE_PERIODS) {
+	d->target = d->fill;
+	return;
     }
+    d->periods = DRIFT_SETTLE_PERIODS + 1;
+
+    /* More waiting than the target, the guest is ahead: consume faster */
+    err = (d->fill - d->target) / need;
+    d->integral += err;
+    adjust = DRIFT_KP * err + DRIFT_KI * d->integral;
+    if (adjust > DRIFT_MAX_ADJUST || adjust < -DRIFT_MAX_ADJUST) {
+	/* No wind up while saturated */
+	d->integral -= err;
+	adjust = adjust > 0 ? DRIFT_MAX_ADJUST : -DRIFT_MAX_ADJUST;
+    }
+    d->adjust = adjust;
+    resampler_adjust(as->rs, adjust);
 }
 
-static void double_mono(int16_t *src, int16_t *dst)
+static void process_playback_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
 {
-    int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i] = dst[i+1] = src[i/2];
+    struct alsa_stream *as = &xvb->p;
+
+    switch (fe_cmd->cmd) {
+    case XC_PCM_OPEN:
+	as->running = 0;
+	break;
+    case XC_PCM_CLOSE:
+	as->running = 0;
+	break;
+    case XC_PCM_PREPARE:
+	as->running = 0;
+	as->hw_ptr = as->processed = as->processed_periods = 0;
+	resampler_reset(as->rs);
+	drift_reset(as);
+	break;
+    case XC_TRIGGER_START:
+	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
+	generate_period_interrupt(xvb);
+	drift_reset(as);
+	as->running = 1;
+	break;
+    case XC_TRIGGER_STOP:
+	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
+	generate_period_interrupt(xvb);
+	as->running = 0;
+	break;
     }
 }
 
-int number = 0;
-static void alsa_repare(struct xen_vsnd_backend *xvb)
+static void process_capture_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
 {
-    snd_pcm_drop(xvb->p.handle);
-    snd_pcm_drop(xvb->c.handle);
-    snd_pcm_resume(xvb->p.handle);
-    snd_pcm_resume(xvb->c.handle);
-    snd_pcm_prepare(xvb->p.handle);
-    snd_pcm_prepare(xvb->c.handle);
-    number = 0;
-    snd_pcm_start(xvb->c.handle);
+    struct alsa_stream *as = &xvb->c;
+
+    switch (fe_cmd->cmd) {
+    case XC_PCM_OPEN:
+	as->running = 0;
+	break;
+    case XC_PCM_CLOSE:
+	as->running = 0;
+	break;
+    case XC_PCM_PREPARE:
+	as->running = 0;
+	as->hw_ptr = as->processed = as->processed_periods = 0;
+	if (as->rs)
+	    resampler_reset(as->rs);
+	break;
+    case XC_TRIGGER_START:
+	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
+	generate_period_interrupt(xvb);
+	as->running = 1;
+	break;
+    case XC_TRIGGER_STOP:
+	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
+	generate_period_interrupt(xvb);
+	as->running = 0;
+	break;
+    }
+}
+
+/* Carry out the commands waiting for a guest, from the audio thread */
+static void run_commands(struct xen_vsnd_backend *xvb)
+{
+    struct fe_cmd cmd;
+
+    while (cmdq_pop(xvb->cmdq, &cmd)) {
+	if (cmd.stream == XC_STREAM_PLAYBACK)
+	    process_playback_cmd(&cmd, xvb);
+	else
+	    process_capture_cmd(&cmd, xvb);
+    }
 }
 
-static void capture_callback(snd_async_handler_t *ahandler)
+static void run_all_commands(void)
 {
-    struct xen_vsnd_backend *xvb = snd_async_handler_get_callback_private(ahandler);
-    char orig_input[4096];
-    char clean_input[4096];
+    struct xen_vsnd_backend *xvb;
+
+    pthread_mutex_lock(&hw.lock);
+    for (xvb = hw.guests; xvb; xvb = xvb->next)
+	run_commands(xvb);
+    pthread_mutex_unlock(&hw.lock);
+}
+
+/* Hand a captured period to a guest, through the stages it asked for */
+static void capture_to_guest(struct xen_vsnd_backend *xvb, int frames)
+{
+    struct alsa_stream *as = &xvb->c;
+    int16_t guest_frame[GUEST_PERIOD_MAX_FRAMES * 2];
+    int16_t *input;
+
+    if (as->running > 1) {
+	input = (int16_t *)dsp_capture(load_acquire(&xvb->dsp));
+
+	if (as->rs) {
+	    resampler_push(as->rs, input, frames);
+	    as->period_frames = resampler_pull(as->rs, guest_frame,
+					       GUEST_PERIOD_MAX_FRAMES);
+	    put_data_to_sg(guest_frame, as->period_frames * 4, as);
+	} else {
+	    as->period_frames = frames;
+	    put_data_to_sg(input, frames * 4, as);
+	}
+	alsa_refresh_be_capture_info(as);
+	xvb->notify = 1;
+    } else if (as->running == 1) {
+	as->running = 2;
+	/* nothing else to do */
+    }
+}
+
+/*
+ * Add a period of a guest's playback to the mix, and as many of its
+ * frames as it takes to make one at the card's rate, give or take the
+ * drift compensation.
+ */
+static void playback_from_guest(struct xen_vsnd_backend *xvb, int32_t *mix,
+				int16_t *frame)
+{
+    struct alsa_stream *as = &xvb->p;
+    int16_t guest_frame[GUEST_PERIOD_MAX_FRAMES * 2];
+    int need, live;
+
+    if (!as->running)
+	return;
+
+    need = resampler_need(as->rs, hw.period);
+    live = alsa_get_live_frames(as);
+    if (live >= need) {
+	drift_update(as, live - need, need);
+	get_data_from_sg(guest_frame, need * 4, as);
+	resampler_push(as->rs, guest_frame, need);
+	resampler_pull(as->rs, frame, hw.period);
+	as->period_frames = need;
+	mix_add(mix, frame, hw.period * 2, load_acquire(&xvb->gain));
+
+	if (as->running < 2) {
+	    as->running++;
+	} else {
+	    alsa_refresh_be_playback_info(as, as->period_frames);
+	    xvb->notify = 1;
+	}
+    }
+}
+
+/* One card period in each direction, paced by the capture stream */
+static void audio_period(void)
+{
+    int16_t input[PERIOD_FRAMES * 2];
     char output_frame[4096];
-    int generate_period = 0;
-    struct alsa_stream *as;
+    int16_t frame[PERIOD_FRAMES * 2];
+    int32_t mix[PERIOD_FRAMES * 2];
+    struct xen_vsnd_backend *xvb;
+    snd_pcm_sframes_t p_delay, c_delay;
     int read, written;
     int avail;
+    int voice = 0;
+    int i;
 
-    if (number == 0) {
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	number = 1;
+    if (!hw.primed) {
+	for (i = 0; i < levels[hw.level].periods - 1; i++) {
+	    written = snd_pcm_writei(hw.p_handle, null_buffer, hw.period);
+	    if (written > 0)
+		dsp_reference((int16_t *)null_buffer, written);
+	}
+    	hw.primed = 1;
     }
 
-    as = &xvb->c;
-    avail = snd_pcm_avail(as->handle);
+    avail = snd_pcm_avail(hw.c_handle);
     if (avail < 0) {
 	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
+	alsa_repare();
 	return;
     }
 
-    if (avail < 1024)
+    if (avail < hw.period)
 	return;
 
-    read = snd_pcm_readi(as->handle, orig_input, PERIOD_FRAMES);
+    read = snd_pcm_readi(hw.c_handle, input, hw.period);
     if (read < 0) {
 	printf("restarting for read=%d\n", read);
-	alsa_repare(xvb);
+	alsa_repare();
 	return;
     }
-    pthread_mutex_lock(&as->mutex);
-    if (capture_is_running > 1) {
 
-	fill_averege(orig_input, mono_input);
-
-	speex_echo_playback(echo_state, prev_buf_2); 
-	speex_echo_capture(echo_state, mono_input, clean_input); 
-	speex_preprocess_run(preprocess_state, clean_input); 
-
-	double_mono(clean_input, orig_input);
-
-	put_data_to_sg((uint16_t *)orig_input, read * 4, as);
-	alsa_refresh_be_capture_info(as);
-	generate_period = 1;
-    } else if (capture_is_running == 1){
-	capture_is_running = 2;
-	/* nothing else to do */
-    }
-    pthread_mutex_unlock(&as->mutex);
-
-    as = &xvb->p;
-    avail = snd_pcm_avail(as->handle);
+    avail = snd_pcm_avail(hw.p_handle);
     if (avail < 0) {
 	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
+	alsa_repare();
 	return;
     }
-    pthread_mutex_lock(&as->mutex);
-    if ((playback_is_running == 0) || (alsa_get_live_frames(as) < 1024) ) {
-	memcpy(output_frame, null_buffer, 4096);
-    } else {
-	get_data_from_sg((uint16_t *)output_frame, PERIOD_FRAMES * 4, as);
- 
-	if(playback_is_running < 2) {
-	    playback_is_running++;
-	} else {
-	    alsa_refresh_be_playback_info(as, 1);
-	    generate_period = 1;
-	}
+
+    mix_clear(mix, hw.period * 2);
+
+    pthread_mutex_lock(&hw.lock);
+
+    /* Only what the guests capturing asked for is done */
+    for (xvb = hw.guests; xvb; xvb = xvb->next)
+	if (xvb->c.running > 1)
+	    voice |= load_acquire(&xvb->dsp);
+    if ((voice & DSP_AEC) && !hw.aec)
+	dsp_reset();
+    hw.aec = voice & DSP_AEC;
+    if (hw.aec && !snd_pcm_delay(hw.p_handle, &p_delay) &&
+	!snd_pcm_delay(hw.c_handle, &c_delay))
+	dsp_set_delay(p_delay + c_delay);
+    dsp_begin(input, read);
+
+    for (xvb = hw.guests; xvb; xvb = xvb->next) {
+	run_commands(xvb);
+	capture_to_guest(xvb, read);
+	playback_from_guest(xvb, mix, frame);
     }
-    pthread_mutex_unlock(&as->mutex);
+    for (xvb = hw.guests; xvb; xvb = xvb->next) {
+	if (xvb->notify)
+	    generate_period_interrupt(xvb);
+	xvb->notify = 0;
+    }
+    pthread_mutex_unlock(&hw.lock);
+
+    mix_out((int16_t *)output_frame, mix, hw.period * 2);
 
-    written = snd_pcm_writei(as->handle, output_frame, PERIOD_FRAMES);
+    written = snd_pcm_writei(hw.p_handle, output_frame, hw.period);
     if (written < 0) {
 	printf("restarting for snd_pcm_writei: written=%d\n", written);
-	alsa_repare(xvb);
+	alsa_repare();
 	return;
     }
-    memcpy(prev_buf_2, prev_buf_1, 2048);
-    fill_averege(output_frame, prev_buf_1);
-
-    if (generate_period)
-	generate_period_interrupt();
-
+    dsp_reference((int16_t *)output_frame, written);
 }
 
 
-int alsa_open(struct alsa_stream *as, struct xen_vsnd_backend *xvb)
+static int alsa_configure(snd_pcm_t *handle, int period_frames,
+			  int buffer_frames, unsigned int *rate)
 {
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
     int err;
-    int period_frames;
-    int buffer_frames;
 
-    pthread_mutex_lock(&as->mutex);
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
 
-    snd_pcm_hw_params_alloca(&as->hwparams);
-    snd_pcm_sw_params_alloca(&as->swparams);
+    if ((err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
+			    period_frames, buffer_frames, rate)) < 0) {
+	printf("Setting of p_hwparams failed: %s\n", snd_strerror(err));
+	return err;
+    }
+    if ((err = set_swparams(handle, swparams)) < 0) {
+	printf("Setting of p_swparams failed: %s\n", snd_strerror(err));
+	return err;
+    }
 
-    err = snd_output_stdio_attach(&output, stdout, 0);
-    if (err < 0) {
-	printf("Output failed: %s\n", snd_strerror(err));
-	return 0;
+    //snd_pcm_dump(handle, output);
+    snd_pcm_prepare(handle);
+
+    return 0;
+}
+
+static snd_pcm_t *alsa_open(int stream_type, unsigned int *rate)
+{
+    snd_pcm_t *handle;
+    int err;
+
+    if (!output) {
+	err = snd_output_stdio_attach(&output, stdout, 0);
+	if (err < 0) {
+	    printf("Output failed: %s\n", snd_strerror(err));
+	    return NULL;
+	}
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-	period_frames = P_PERIOD_FRAMES;
-	buffer_frames = P_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    if (stream_type == XC_STREAM_PLAYBACK) {
+	if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 	    printf("Playback open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return NULL;
 	}
     } else {
-	period_frames = C_PERIOD_FRAMES;
-	buffer_frames = C_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+	if ((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
 	    printf("Capture open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return NULL;
 	}
     }
 
-    if ((err = set_hwparams(as->handle, as->hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
-			    period_frames, buffer_frames)) < 0) {
-	printf("Setting of p_hwparams failed: %s\n", snd_strerror(err));
+    if (alsa_configure(handle, hw.period, hw.buffer, rate))
 	exit(EXIT_FAILURE);
+
+    return handle;
+}
+
+/* The card's period and buffer, in the guest's frames */
+static void publish_sizes(struct xen_vsnd_backend *xvb)
+{
+    uint32_t period = (uint64_t)hw.period * xvb->rate / hw.rate;
+    uint32_t buffer = (uint64_t)hw.buffer * xvb->rate / hw.rate;
+
+    xvb->p.be_info->period_frames = period;
+    xvb->p.be_info->buffer_frames = buffer;
+    xvb->c.be_info->period_frames = period;
+    xvb->c.be_info->buffer_frames = buffer;
+    wmb();
+}
+
+/*
+ * Move the card to another level, from the audio thread. Both streams
+ * are stopped and set up again, and start over from fresh silence. If
+ * the card will not take it, it goes back to the level it was on.
+ */
+static void set_level(int level)
+{
+    struct xen_vsnd_backend *xvb;
+    unsigned int p_rate = hw.rate;
+    unsigned int c_rate = hw.rate;
+    int period = levels[level].period;
+    int buffer = period * levels[level].periods;
+
+    snd_pcm_drop(hw.p_handle);
+    snd_pcm_drop(hw.c_handle);
+    if (alsa_configure(hw.p_handle, period, buffer, &p_rate) ||
+	alsa_configure(hw.c_handle, period, buffer, &c_rate) ||
+	p_rate != hw.rate || c_rate != hw.rate) {
+	printf("Unable to move to periods of %d frames\n", period);
+	alsa_configure(hw.p_handle, hw.period, hw.buffer, &p_rate);
+	alsa_configure(hw.c_handle, hw.period, hw.buffer, &c_rate);
+	level = hw.level;
+    } else {
+	printf("Periods of %d frames, %d in the buffer\n", period,
+	       levels[level].periods);
     }
-    if ((err = set_swparams(as->handle, as->swparams)) < 0) {
-	printf("Setting of p_swparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+
+    pthread_mutex_lock(&hw.lock);
+    hw.level = level;
+    hw.period = levels[level].period;
+    hw.buffer = hw.period * levels[level].periods;
+    for (xvb = hw.guests; xvb; xvb = xvb->next) {
+	publish_sizes(xvb);
+	drift_reset(&xvb->p);
     }
+    pthread_mutex_unlock(&hw.lock);
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-    	/* nothing to do, we only rely on the capture callback */
-    } else {
-    	err = snd_async_add_pcm_handler(&as->ahandler, as->handle, capture_callback, xvb);
-    	if (err < 0) {
-    	    printf("Unable to register async handler\n");
-    	    exit(EXIT_FAILURE);
-    	}
+    hw.last_change = now_ms();
+    hw.primed = 0;
+    snd_pcm_start(hw.c_handle);
+}
+
+/*
+ * The audio thread sleeps in poll() on the capture PCM, and wakes up for
+ * each capture period to move a period in both directions. The playback
+ * PCM is only watched for errors, its writes are paced by the capture
+ * side. A byte on the stop pipe asks the thread to exit.
+ */
+static void *audio_thread(void *arg)
+{
+    struct pollfd *pfds;
+    unsigned short revents;
+    int nc, np, i, n, level;
+
+    /* Setting a new level may change the descriptors, so start over */
+again:
+    level = hw.level;
+    nc = snd_pcm_poll_descriptors_count(hw.c_handle);
+    np = snd_pcm_poll_descriptors_count(hw.p_handle);
+    if (nc < 0 || np < 0) {
+	printf("audio thread: no poll descriptors\n");
+	return NULL;
     }
+    pfds = calloc(1 + nc + np, sizeof (*pfds));
+    if (!pfds)
+	return NULL;
+
+    pfds[0].fd = hw.wake[0];
+    pfds[0].events = POLLIN;
+    snd_pcm_poll_descriptors(hw.c_handle, pfds + 1, nc);
+    snd_pcm_poll_descriptors(hw.p_handle, pfds + 1 + nc, np);
+    for (i = 0; i < np; i++)
+	pfds[1 + nc + i].events = 0;
+
+    for (;;) {
+	n = poll(pfds, 1 + nc + np, AUDIO_POLL_TIMEOUT_MS);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    printf("audio thread: poll: %s\n", strerror(errno));
+	    break;
+	}
+	if (pfds[0].revents) {
+	    char buf[64];
+
+	    while (read(hw.wake[0], buf, sizeof (buf)) > 0)
+		continue;
+	    if (load_acquire(&hw.stopping))
+		break;
+	    run_all_commands();
+	}
+	for (i = 0; i < np; i++)
+	    if (pfds[1 + nc + i].revents & (POLLERR | POLLHUP))
+		break;
+
+	if (n == 0) {
+	    printf("restarting for no capture period in %dms\n",
+		   AUDIO_POLL_TIMEOUT_MS);
+	    alsa_repare();
+	} else if (i < np) {
+	    printf("restarting for playback poll error\n");
+	    alsa_repare();
+	} else {
+	    snd_pcm_poll_descriptors_revents(hw.c_handle, pfds + 1, nc,
+					     &revents);
+	    if (revents & (POLLIN | POLLERR)) {
+		audio_period();
+		maybe_shrink();
+	    }
+	}
 
-    //snd_pcm_dump(as->handle, output);
-    pthread_mutex_unlock(&as->mutex);
+	/* Whichever of the above xruns or shrinks may have changed it */
+	if (hw.level != level) {
+	    free(pfds);
+	    goto again;
+	}
+    }
+
+    free(pfds);
+    return NULL;
 }
 
-void init_alsa(struct xen_vsnd_backend *xvb)
+/* Start the audio thread, SCHED_FIFO if we are allowed to */
+static int start_audio_thread(void)
 {
-    struct alsa_stream *as;
-    int written;
+    struct sched_param sp;
+    pthread_attr_t attr;
+    int err;
 
-    printf("init_alsa\n");
+    if (pipe(hw.wake)) {
+	printf("Unable to create the audio thread wake pipe\n");
+	return -1;
+    }
+    fcntl(hw.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(hw.wake[1], F_SETFL, O_NONBLOCK);
+    hw.stopping = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    sp.sched_priority = AUDIO_THREAD_PRIORITY;
+    pthread_attr_setschedparam(&attr, &sp);
+
+    err = pthread_create(&hw.thread, &attr, audio_thread, NULL);
+    if (err == EPERM) {
+	printf("No real-time scheduling for the audio thread\n");
+	err = pthread_create(&hw.thread, NULL, audio_thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    if (err) {
+	printf("Unable to start the audio thread: %s\n", strerror(err));
+	close(hw.wake[0]);
+	close(hw.wake[1]);
+	return -1;
+    }
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    return 0;
+}
 
-    //snd_pcm_link(xvb->c.handle, xvb->p.handle);
+static void wake_audio_thread(void)
+{
+    char c = 0;
 
-    snd_pcm_start(xvb->c.handle);
+    while (write(hw.wake[1], &c, 1) < 0 && errno == EINTR)
+	continue;
 }
 
-void cleanup_alsa(struct xen_vsnd_backend *xvb)
+static void stop_audio_thread(void)
 {
-    struct alsa_stream *as;
+    store_release(&hw.stopping, 1);
+    wake_audio_thread();
+    pthread_join(hw.thread, NULL);
+    close(hw.wake[0]);
+    close(hw.wake[1]);
+}
 
-    printf("cleanup_alsa\n");
+static void close_hw(void)
+{
+    stop_audio_thread();
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    snd_pcm_close(as->handle);
+    snd_pcm_close(hw.p_handle);
+    snd_pcm_close(hw.c_handle);
+    hw.p_handle = hw.c_handle = NULL;
+}
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    snd_pcm_close(as->handle);
+static void free_resamplers(struct xen_vsnd_backend *xvb)
+{
+    resampler_free(xvb->p.rs);
+    resampler_free(xvb->c.rs);
+    xvb->p.rs = xvb->c.rs = NULL;
 }
 
-void init_speex()
+/*
+ * Convert between the guest's rate and the card's. Playback always goes
+ * through a resampler, for the drift compensation, capture only if the
+ * rates differ.
+ */
+static int init_resamplers(struct xen_vsnd_backend *xvb)
 {
-    int rate=44100;
-    spx_int32_t tmp;
+    if (xvb->rate > 2 * hw.rate) {
+	printf("Guest rate %dHz too high for the card at %dHz\n",
+	       xvb->rate, hw.rate);
+	return -1;
+    }
 
-    echo_state = speex_echo_state_init(1024, 8192);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    xvb->p.rs = resampler_new(xvb->rate, hw.rate, resample_quality);
+    if (xvb->rate != hw.rate)
+	xvb->c.rs = resampler_new(hw.rate, xvb->rate, resample_quality);
+    if (!xvb->p.rs || (xvb->rate != hw.rate && !xvb->c.rs)) {
+	printf("Unable to resample between %dHz and %dHz\n",
+	       xvb->rate, hw.rate);
+	free_resamplers(xvb);
+	return -1;
+    }
+    printf("resampling %d between %dHz and %dHz, quality %d\n",
+	   xvb->devid, xvb->rate, hw.rate, resample_quality);
 
-    preprocess_state = speex_preprocess_state_init(1024, 44100);
+    return 0;
+}
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_AGC, &tmp);
+/*
+ * The sound card is opened when the first guest connects, and closed
+ * when the last one goes. Both run from the main loop.
+ */
+int init_alsa(struct xen_vsnd_backend *xvb)
+{
+    unsigned int p_rate = alsa_rate;
+    unsigned int c_rate = alsa_rate;
+
+    printf("init_alsa %d\n", xvb->devid);
+
+    if (!hw.users) {
+	hw.level = low_latency ? 0 : N_LEVELS - 1;
+	hw.period = levels[hw.level].period;
+	hw.buffer = hw.period * levels[hw.level].periods;
+	hw.xruns = 0;
+	hw.shrunk = 0;
+	hw.shrink_after = SHRINK_AFTER_MS;
+	hw.last_change = hw.last_xrun = now_ms();
+
+	hw.p_handle = alsa_open(XC_STREAM_PLAYBACK, &p_rate);
+	hw.c_handle = alsa_open(XC_STREAM_CAPTURE, &c_rate);
+	if (!hw.p_handle || !hw.c_handle)
+	    exit(EXIT_FAILURE);
+	if (p_rate != c_rate) {
+	    printf("Playback at %uHz and capture at %uHz\n", p_rate, c_rate);
+	    exit(EXIT_FAILURE);
+	}
+	hw.rate = p_rate;
 
-    tmp = 1;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+	if (dsp_init(hw.rate, low_latency ? LOW_LATENCY_BLOCK : PERIOD_FRAMES,
+		     PERIOD_FRAMES, dsp_stages)) {
+	    printf("Unable to set up the voice processing\n");
+	    exit(EXIT_FAILURE);
+	}
 
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
-    
-    tmp = -60;
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
+	//snd_pcm_link(hw.c_handle, hw.p_handle);
 
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);  
-  
-}
+	hw.primed = 0;
+	snd_pcm_start(hw.c_handle);
 
-void process_playback_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
-{
-    int ret;
+	if (start_audio_thread())
+	    exit(EXIT_FAILURE);
+    }
 
-    pthread_mutex_lock(&as->mutex);   
-    switch (fe_cmd->cmd) {
-    case XC_PCM_OPEN:
-	playback_is_running = 0;
-	break;
-    case XC_PCM_CLOSE:
-	playback_is_running = 0;
-	break;
-    case XC_PCM_PREPARE:
-	playback_is_running = 0;
-	as->hw_ptr = as->processed = as->processed_periods = 0;
-	break;
-    case XC_TRIGGER_START:
-	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	playback_is_running = 1;
-	break;
-    case XC_TRIGGER_STOP:
-	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	playback_is_running = 0;
-	break;
+    if (dsp_prepare(xvb->dsp) || init_resamplers(xvb)) {
+	if (!hw.users)
+	    close_hw();
+	return -1;
     }
-    pthread_mutex_unlock(&as->mutex);   
+    hw.users++;
+
+    xvb->p.stream_type = XC_STREAM_PLAYBACK;
+    xvb->c.stream_type = XC_STREAM_CAPTURE;
+
+    pthread_mutex_lock(&hw.lock);
+    xvb->next = hw.guests;
+    hw.guests = xvb;
+    publish_sizes(xvb);
+    pthread_mutex_unlock(&hw.lock);
+
+    return 0;
 }
 
-void process_capture_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+void cleanup_alsa(struct xen_vsnd_backend *xvb)
 {
-    int ret;
+    struct xen_vsnd_backend **pp;
+    int found = 0;
 
-    pthread_mutex_lock(&as->mutex);   
-    switch (fe_cmd->cmd) {
-    case XC_PCM_OPEN:
-	capture_is_running = 0;
-	break;
-    case XC_PCM_CLOSE:
-	capture_is_running = 0;
-	break;
-    case XC_PCM_PREPARE:
-	capture_is_running = 0;
-	as->hw_ptr = as->processed = as->processed_periods = 0;
-	break;
-    case XC_TRIGGER_START:
-	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	capture_is_running = 1;
-	break;
-    case XC_TRIGGER_STOP:
-	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	capture_is_running = 0;
-	break;
+    printf("cleanup_alsa %d\n", xvb->devid);
+
+    pthread_mutex_lock(&hw.lock);
+    for (pp = &hw.guests; *pp; pp = &(*pp)->next)
+	if (*pp == xvb) {
+	    *pp = xvb->next;
+	    found = 1;
+	    break;
+	}
+    pthread_mutex_unlock(&hw.lock);
+
+    /* init_alsa() was not reached if the connection failed */
+    if (!found)
+	return;
+
+    /* Out of the list, the audio thread is done with them */
+    free_resamplers(xvb);
+
+    if (!--hw.users)
+	close_hw();
+}
+
+/*
+ * Commands from the main loop, queued for the audio thread. Returns -1
+ * if too many are already waiting.
+ */
+int alsa_queue_cmd(struct xen_vsnd_backend *xvb, struct fe_cmd *fe_cmd)
+{
+    if (cmdq_push(xvb->cmdq, fe_cmd)) {
+	printf("command queue of %d full, dropping command %d\n",
+	       xvb->devid, fe_cmd->cmd);
+	return -1;
     }
-    pthread_mutex_unlock(&as->mutex);   
+    /* Carried out when the guest joins the mix otherwise */
+    if (hw.users)
+	wake_audio_thread();
+
+    return 0;
 }
 
+/* The voice stages of a guest's capture, from the main loop */
+int alsa_set_dsp(struct xen_vsnd_backend *xvb, int stages)
+{
+    /* Set up when it joins the mix otherwise */
+    if (hw.users && dsp_prepare(stages)) {
+	printf("Unable to set up the voice processing of %d\n", xvb->devid);
+	return -1;
+    }
+    store_release(&xvb->dsp, stages);
+
+    return 0;
+}
@@ -41,15 +41,26 @@
 #include <stdint.h>
 #include <time.h>
 #include <pthread.h>
+#include <errno.h>
 
 #include "ring.h"
 #include "mb.h"
 #include "audio-daemon.h"
+#include "sgcopy.h"
+#include "cmdq.h"
+#include "resample.h"
+#include "dsp.h"
+#include "hvmtime.h"
 
 struct xc_interface *xc_handle = NULL;
-struct xen_vsnd_backend *glob_xvb;
 char paulian_debug[4];
-struct ring_t *cmd_ring = 0;
+static int buffer_pages = N_AUD_BUFFER_PAGES;
+
+/* What a frontend may ask for in its "sample-rate" node */
+static const int guest_rates[] = {
+    8000, 11025, 16000, 22050, 32000, 44100, 48000
+};
+#define N_GUEST_RATES (sizeof (guest_rates) / sizeof (guest_rates[0]))
 
 struct xen_vsnd_device
 {
@@ -58,18 +69,49 @@ struct xen_vsnd_device
 };
 
 static struct event backend_xenstore_event;
+static struct event hvmtime_event;
+
+static int hvm_get_time(uint64_t *now)
+{
+    return xc_hvm_get_time(xc_handle, now);
+}
 
 /* Backend vsnd operations */
 uint64_t get_nsec_now(void)
 {
-    uint64_t now;
-    xc_hvm_get_time(xc_handle, &now);
-    return now;
+    return hvmtime_now();
+}
+
+/*
+ * Calibrate the timestamps, and say how far off they were: once a
+ * minute, and whenever that is more than HVMTIME_WARN_NS.
+ */
+static void hvmtime_handler(int fd, short event, void *priv)
+{
+    static unsigned int count;
+    struct timeval tv = { HVMTIME_CALIBRATE_MS / 1000, 0 };
+    struct hvmtime_stats st;
+    int rc;
+
+    rc = hvmtime_calibrate();
+    hvmtime_get_stats(&st);
+    if (rc)
+	printf("time calibration failed (%llu of %llu)\n",
+	       (unsigned long long)st.failures,
+	       (unsigned long long)(st.calibrations + st.failures));
+    else if (++count % (60000 / HVMTIME_CALIBRATE_MS) == 0 ||
+	     st.error > HVMTIME_WARN_NS || st.error < -HVMTIME_WARN_NS)
+	printf("time calibration: error %lldns (max %lldns), "
+	       "uncertainty %lluns, rate %+lldppb\n",
+	       (long long)st.error, (long long)st.max_error,
+	       (unsigned long long)st.uncertainty, (long long)st.ppb);
+
+    evtimer_add(&hvmtime_event, &tv);
 }
 
-void generate_period_interrupt(struct alsa_stream *as)
+void generate_period_interrupt(struct xen_vsnd_backend *xvb)
 {
-    backend_evtchn_notify(glob_xvb->back, glob_xvb->devid);
+    backend_evtchn_notify(xvb->back, xvb->devid);
 }
 
 void *playback_worker_thread(void *arg);
@@ -79,19 +121,23 @@ static xen_device_t xen_vsnd_alloc(xen_backend_t backend, int devid, void *priv)
 {
     struct xen_vsnd_device *dev = priv;
     struct xen_vsnd_backend *xvb;
-    int err;
 
-    xvb = (struct xen_vsnd_backend*) malloc(sizeof (*xvb));
+    xvb = (struct xen_vsnd_backend*) calloc(1, sizeof (*xvb));
+    if (!xvb)
+	return NULL;
     xvb->devid = devid;
     xvb->dev = dev;
     xvb->back = backend;
-
-    glob_xvb = xvb;
-
-    err = pthread_mutex_init(&xvb->p.mutex, NULL);
-    err = pthread_mutex_init(&xvb->c.mutex, NULL);
-
-    init_speex();
+    xvb->buffer_pages = buffer_pages;
+    xvb->gain = PCM_GAIN_UNITY;
+    xvb->rate = GUEST_SAMPLE_RATE;
+    xvb->dsp = dsp_stages & DSP_VOICE;
+
+    xvb->cmdq = calloc(1, sizeof (*xvb->cmdq));
+    if (!xvb->cmdq) {
+	free(xvb);
+	return NULL;
+    }
 
     return xvb;
 }
@@ -99,8 +145,23 @@ static xen_device_t xen_vsnd_alloc(xen_backend_t backend, int devid, void *priv)
 static int xen_vsnd_init(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
-
-    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", SAMPLE_RATE);
+    char rates[N_GUEST_RATES * 8];
+    int i, n = 0;
+
+    for (i = 0; i < N_GUEST_RATES; i++)
+	n += sprintf(rates + n, "%s%d", i ? "," : "", guest_rates[i]);
+
+    /*
+     * sample-rate is the rate of frontends that don't ask for one, and
+     * the one agreed on once connected. native-sample-rate is the one
+     * of the sound card, which needs no resampling.
+     */
+    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", xvb->rate);
+    backend_print(xvb->back, xvb->devid, "sample-rates", "%s", rates);
+    backend_print(xvb->back, xvb->devid, "native-sample-rate", "%d", alsa_rate);
+    backend_print(xvb->back, xvb->devid, "formats", "s16le");
+    backend_print(xvb->back, xvb->devid, "channels", "2");
+    backend_print(xvb->back, xvb->devid, "buffer-pages", "%d", xvb->buffer_pages);
 
     return 0;
 }
@@ -110,14 +171,49 @@ static void xen_vsnd_evtchn_handler(int xvb, short event, void *priv)
     backend_evtchn_handler(priv);
 }
 
+/* Map the pages of a DMA buffer as one contiguous region */
+static int map_dma_buffer(struct xen_vsnd_backend *xvb, struct alsa_stream *as,
+			  uint32_t *refs)
+{
+    xen_pfn_t pfns[MAX_AUD_BUFFER_PAGES];
+    int i;
+
+    for (i=0; i<xvb->buffer_pages; i++)
+	pfns[i] = refs[i];
+
+    as->dma_buffer = xc_map_foreign_pages(xc_handle, xvb->dev->domid,
+					  PROT_READ | PROT_WRITE,
+					  pfns, xvb->buffer_pages);
+    if (!as->dma_buffer)
+	return -1;
+    as->buffer_bytes = xvb->buffer_pages * XENVSND_PAGE_SIZE;
+
+    return 0;
+}
+
+static void unmap_dma_buffer(struct alsa_stream *as)
+{
+    if (!as->dma_buffer)
+	return;
+    munmap(as->dma_buffer, as->buffer_bytes);
+    as->dma_buffer = NULL;
+}
+
+static void xen_vsnd_disconnect(xen_device_t xendev);
+
 static int xen_vsnd_connect(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
-    int fd, i;
+    int fd;
     uint32_t *page_ref;
 
     printf("%s\n", __FUNCTION__); fflush(stdout);
 
+    if (!xvb->rate || xvb->format_refused) {
+	printf("Refusing frontend %d, unsupported format\n", xvb->devid);
+	return -1;
+    }
+
     fd = backend_bind_evtchn(xvb->back, xvb->devid);
     if (fd < 0)
         return -1;
@@ -128,46 +224,51 @@ static int xen_vsnd_connect(xen_device_t xendev)
     event_add(&xvb->evtchn_event, NULL);
 
     page_ref = xvb->page = backend_map_shared_page(xvb->back, xvb->devid);
-    if (!page_ref)
+    if (!page_ref) {
+        event_del(&xvb->evtchn_event);
+        backend_unbind_evtchn(xvb->back, xvb->devid);
         return -1;
+    }
 
 
-    for (i=0; i<N_AUD_BUFFER_PAGES; i++) {
-	xvb->p.dma_buffer[i] = (void *)xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							    XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							    page_ref[100 + i]);
+    if (map_dma_buffer(xvb, &xvb->p, &page_ref[100]) ||
+	map_dma_buffer(xvb, &xvb->c, &page_ref[200])) {
+	printf("Failed to map the DMA buffers\n");
+	goto fail;
     }
-    
-    for (i=0; i<N_AUD_BUFFER_PAGES; i++) {
-	xvb->c.dma_buffer[i] = (void *)xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							    XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							    page_ref[200 + i]);
-    }
-    
+
 	/* cmd_ring */
-    if (!cmd_ring) {
+    if (!xvb->cmd_ring) {
         printf("MAPPING CMDS RING!\n");
-    	cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							  XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							  page_ref[300]);
-	ring_init(cmd_ring);
+    	xvb->cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
+							       XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
+							       page_ref[300]);
+	if (!xvb->cmd_ring)
+	    goto fail;
+	ring_init(xvb->cmd_ring);
     }
 
     xvb->p.be_info = (struct be_info *) &page_ref[400];
 	
     xvb->c.be_info = (struct be_info *) &page_ref[500];
 
-    init_alsa(xvb);
+    if (init_alsa(xvb))
+	goto fail;
+    backend_print(xvb->back, xvb->devid, "sample-rate", "%d", xvb->rate);
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
     return 0;
+
+fail:
+    /* Or the guest's commands pile up in a queue nothing drains */
+    xen_vsnd_disconnect(xvb);
+    return -1;
 }
 
 
 static void xen_vsnd_disconnect(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
-    int i;
 
     printf("%s\n", __FUNCTION__); fflush(stdout);
     if (xvb->page == NULL)
@@ -184,18 +285,13 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 	xvb->page = NULL;
     }
 
-    for (i=0; i<N_AUD_BUFFER_PAGES; i++) {
-	munmap(xvb->p.dma_buffer[i], XENVSND_PAGE_SIZE);
-	xvb->p.dma_buffer[i] = NULL;
-    }
-    
-    for (i=0; i<N_AUD_BUFFER_PAGES; i++) {
-	munmap(xvb->c.dma_buffer[i], XENVSND_PAGE_SIZE);
-	xvb->c.dma_buffer[i] = NULL;
-    }
+    unmap_dma_buffer(&xvb->p);
+    unmap_dma_buffer(&xvb->c);
 
-    munmap(cmd_ring, XENVSND_PAGE_SIZE);
-    cmd_ring = NULL;
+    if (xvb->cmd_ring) {
+	munmap(xvb->cmd_ring, XENVSND_PAGE_SIZE);
+	xvb->cmd_ring = NULL;
+    }
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
 }
@@ -207,8 +303,11 @@ static void xen_vsnd_event(xen_device_t xendev)
     struct fe_cmd cmd;
     int len;
 
+    if (!xvb->cmd_ring)
+	return;
+
     while (1) {
-	len = ring_read(cmd_ring, (void *)&cmd, sizeof(cmd));
+	len = ring_read(xvb->cmd_ring, (void *)&cmd, sizeof(cmd));
 	if (len == sizeof(cmd)) {
 
 	    printf("(%d) ", cmd.stream);
@@ -230,22 +329,79 @@ static void xen_vsnd_event(xen_device_t xendev)
 	    	break;
 	    }
 
-	    if (cmd.stream == XC_STREAM_PLAYBACK)
-		process_playback_cmd(&cmd, &xvb->p);
-	    else
-		process_capture_cmd(&cmd, &xvb->c);	
+	    alsa_queue_cmd(xvb, &cmd);
 	} else {
 	    return;
 	}
     }
 }
 
+/*
+ * The toolstack sets the playback volume of a guest in the mix, and the
+ * voice processing of its capture, as in -d ("none" for the raw capture).
+ */
+static void xen_vsnd_backend_changed(xen_device_t xendev, const char *node,
+				     const char *val)
+{
+    struct xen_vsnd_backend *xvb = xendev;
+    int gain, stages;
+
+    if (!val)
+	return;
+
+    if (!strcmp(node, "volume")) {
+	gain = atoi(val);
+	if (gain < 0)
+	    gain = 0;
+	if (gain > PCM_GAIN_UNITY)
+	    gain = PCM_GAIN_UNITY;
+	store_release(&xvb->gain, gain);
+    } else if (!strcmp(node, "dsp")) {
+	stages = dsp_parse(val);
+	if (stages < 0) {
+	    printf("%d: unknown dsp stage in %s\n", xvb->devid, val);
+	    return;
+	}
+	alsa_set_dsp(xvb, stages & DSP_VOICE);
+    }
+}
+
+/*
+ * The frontend asks for a rate and format before it connects. Anything
+ * but S16 stereo ("s16le") at one of guest_rates gets it refused on
+ * connect.
+ */
+static void xen_vsnd_frontend_changed(xen_device_t xendev, const char *node,
+				      const char *val)
+{
+    struct xen_vsnd_backend *xvb = xendev;
+    int i, rate;
+
+    if (!val)
+	return;
+
+    if (!strcmp(node, "sample-rate")) {
+	rate = atoi(val);
+	xvb->rate = 0;
+	for (i = 0; i < N_GUEST_RATES; i++)
+	    if (guest_rates[i] == rate)
+		xvb->rate = rate;
+	if (!xvb->rate)
+	    printf("frontend %d: unsupported sample-rate %s\n", xvb->devid, val);
+    } else if (!strcmp(node, "format")) {
+	xvb->format_refused = strcmp(val, "s16le") != 0;
+	if (xvb->format_refused)
+	    printf("frontend %d: unsupported format %s\n", xvb->devid, val);
+    }
+}
+
 static void xen_vsnd_free(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
     struct xen_vsnd_device *dev = xvb->dev;
 
     xen_vsnd_disconnect(xvb);
+    free(xvb->cmdq);
     free(xvb);
 }
 
@@ -255,8 +411,8 @@ static struct xen_backend_ops xen_vsnd_backend_ops = {
     xen_vsnd_init,
     xen_vsnd_connect,
     xen_vsnd_disconnect,
-    NULL,
-    NULL,
+    xen_vsnd_backend_changed,
+    xen_vsnd_frontend_changed,
     xen_vsnd_event,
     xen_vsnd_free
 };
@@ -301,9 +457,65 @@ void xen_backend_init(int dom0)
     event_add(&backend_xenstore_event, NULL);
 }
 
+static void usage(const char *name)
+{
+    printf("usage: %s [-p buffer-pages] [-r sample-rate] [-q quality] "
+	   "[-d stages] [-l] domid...\n", name);
+    printf("  stages: none, or any of downmix,aec,denoise,agc,upmix\n");
+    printf("  -l: low latency, small periods that grow on xruns\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    int companion = atoi(argv[1]);
+    struct timeval tv = { 1, 0 };
+    int domid;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:r:q:d:l")) != -1) {
+	switch (opt) {
+	case 'p':
+	    buffer_pages = atoi(optarg);
+	    if (buffer_pages < 1 || buffer_pages > MAX_AUD_BUFFER_PAGES) {
+		printf("buffer-pages must be between 1 and %d\n",
+		       MAX_AUD_BUFFER_PAGES);
+		return 1;
+	    }
+	    break;
+	case 'r':
+	    alsa_rate = atoi(optarg);
+	    if (alsa_rate < 8000 || alsa_rate > 192000) {
+		printf("sample-rate must be between 8000 and 192000\n");
+		return 1;
+	    }
+	    break;
+	case 'q':
+	    resample_quality = atoi(optarg);
+	    if (resample_quality < RESAMPLE_QUALITY_LOW ||
+		resample_quality > RESAMPLE_QUALITY_HIGH) {
+		printf("quality must be between %d and %d\n",
+		       RESAMPLE_QUALITY_LOW, RESAMPLE_QUALITY_HIGH);
+		return 1;
+	    }
+	    break;
+	case 'd':
+	    dsp_stages = dsp_parse(optarg);
+	    if (dsp_stages < 0)
+		usage(argv[0]);
+	    break;
+	case 'l':
+	    low_latency = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind == argc)
+	usage(argv[0]);
+
+    /* Keep the audio thread clear of page faults */
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+	printf("Unable to lock memory: %s\n", strerror(errno));
 
     event_init ();
 
@@ -311,13 +523,21 @@ int main(int argc, char *argv[])
     if (!xc_handle)
         return -1;
 
+    /* Soon again the first time, for the rate */
+    if (hvmtime_init(hvm_get_time))
+	printf("time calibration failed, timestamps from hypercalls\n");
+    evtimer_set(&hvmtime_event, hvmtime_handler, NULL);
+    evtimer_add(&hvmtime_event, &tv);
+
     xen_backend_init (0);
         
-    printf("companion domain = %d\n", companion);
-    xen_vsnd_device_create(companion); 
+    for (i = optind; i < argc; i++) {
+	domid = atoi(argv[i]);
+	printf("companion domain = %d, %d buffer pages\n", domid, buffer_pages);
+	xen_vsnd_device_create(domid);
+    }
 
     event_dispatch();
 	
     return 0;
 }
-
@@ -50,9 +50,17 @@ struct be_info {
     uint64_t s_time;
     uint64_t appl_ptr;
     enum stream_status status;
+    /* The sound card's, in frames of the guest */
+    uint32_t period_frames;
+    uint32_t buffer_frames;
 };
 
+/*
+ * Pages per direction of the guest DMA buffers, the grant references
+ * start at page_ref[100] for playback and page_ref[200] for capture.
+ */
 #define N_AUD_BUFFER_PAGES 8
+#define MAX_AUD_BUFFER_PAGES 100
 #define XENVSND_PAGE_SIZE 4096
 #define P_PERIOD_FRAMES 1024
 #define P_BUFFER_FRAMES 4096
@@ -60,40 +68,121 @@ struct be_info {
 #define C_BUFFER_FRAMES P_BUFFER_FRAMES
 #define PERIOD_FRAMES P_PERIOD_FRAMES
 #define BUFFER_FRAMES P_BUFFER_FRAMES
-#define SAMPLE_RATE            (44100)
 #define PERIOD_BYTES            (PERIOD_FRAMES * 4)
 
+/*
+ * In low latency mode (-l) the card starts with periods of a few
+ * milliseconds, and its period and buffer grow a step at a time on
+ * xruns, up to the PERIOD_FRAMES and BUFFER_FRAMES of the normal mode.
+ * Periods are multiples of LOW_LATENCY_BLOCK frames.
+ */
+#define LOW_LATENCY_BLOCK       128
+/* Grow after this many xruns, each within the window of the previous */
+#define XRUNS_TO_GROW           2
+#define XRUN_WINDOW_MS          10000
+/* Shrink back after this long without xruns, doubled when it fails */
+#define SHRINK_AFTER_MS         60000
+#define SHRINK_AFTER_MAX_MS     (30 * 60000)
+
+/*
+ * Guests are S16 stereo at a rate of their choosing, which they write in
+ * their "sample-rate" node, GUEST_SAMPLE_RATE if they don't. The sound
+ * card runs at its own rate, see -r, and each guest stream is resampled
+ * to it in the daemon unless they agree. A guest may not go over twice
+ * the rate of the card, so a card period is at most GUEST_PERIOD_MAX_FRAMES
+ * of the guest, with some to spare for drift compensation.
+ */
+#define GUEST_SAMPLE_RATE       44100
+#define HW_SAMPLE_RATE          48000
+#define GUEST_PERIOD_MAX_FRAMES (2 * PERIOD_FRAMES + PERIOD_FRAMES / 16)
+
+/*
+ * Drift compensation: the frames a guest has waiting for playback are
+ * kept around where they settled after it started, by consuming them a
+ * little faster or slower. A PI controller on the filtered fill level
+ * adjusts the ratio of its resampler, by at most DRIFT_MAX_ADJUST. The
+ * error is in periods, and the gains make it critically damped with a
+ * time constant of 2000 periods, slow enough not to chase the jitter of
+ * the guest's writes.
+ */
+#define DRIFT_SETTLE_PERIODS    200
+#define DRIFT_FILTER            (1.0 / 64)
+#define DRIFT_KP                0.001
+#define DRIFT_KI                (DRIFT_KP * DRIFT_KP / 4)
+#define DRIFT_MAX_ADJUST        1000e-6
+
+struct drift {
+    int periods;                /* since the stream started */
+    double fill;                /* guest frames, filtered */
+    double target;
+    double integral;
+    double adjust;              /* of the resampler's ratio */
+};
+
+#define AUDIO_THREAD_PRIORITY 50
+/* Restart the streams if a capture period is this late */
+#define AUDIO_POLL_TIMEOUT_MS 1000
+
+struct resampler;
+
+/*
+ * A guest stream, in the guest's DMA buffer. It belongs to the audio
+ * thread, but for status, which it publishes for the others to read.
+ */
 struct alsa_stream {
     uint8_t stream_type;
-    void *dma_buffer[N_AUD_BUFFER_PAGES];
+    void *dma_buffer;           /* buffer_bytes, mapped contiguously */
+    int buffer_bytes;
     struct be_info *be_info;
     int hw_ptr;
     int app_ptr;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
-    snd_async_handler_t *ahandler;
+    int running;                /* 0 when stopped, up to 2 once started */
+    /* To or from the card, NULL for capture at its rate */
+    struct resampler *rs;
+    int period_frames;          /* of the guest in the last card period */
+    struct drift drift;         /* playback only */
     int vol_l;
     int vol_r;
     enum stream_status status;
-    pthread_mutex_t mutex;
     int32_t processed;
     int32_t processed_periods;
     uint64_t last_time;
     pthread_t worker_thread;
 };
 
+struct cmd_queue;
+
 struct xen_vsnd_backend {
     struct xen_vsnd_device *dev;
     xen_backend_t back;
     int devid;
+    int buffer_pages;
+    int gain;                   /* playback, in percent */
+    int dsp;                    /* voice stages of its capture, see dsp.h */
+    int rate;                   /* as asked by the frontend, 0 if refused */
+    int format_refused;
 
     void *page;
+    struct ring_t *cmd_ring;
+    struct cmd_queue *cmdq;     /* to the audio thread */
     struct event evtchn_event;
 
     struct alsa_stream p;
     struct alsa_stream c;
+
+    struct xen_vsnd_backend *next;  /* in the mixer, see alsa.c */
+    int notify;
 };
 
-struct event audio_work_timer;
-void audio_work(int a, short b, void *arg);
+uint64_t get_nsec_now(void);
+void generate_period_interrupt(struct xen_vsnd_backend *xvb);
+
+extern int alsa_rate;
+extern int resample_quality;
+extern int dsp_stages;
+extern int low_latency;
+
+int init_alsa(struct xen_vsnd_backend *xvb);
+void cleanup_alsa(struct xen_vsnd_backend *xvb);
+int alsa_queue_cmd(struct xen_vsnd_backend *xvb, struct fe_cmd *fe_cmd);
+int alsa_set_dsp(struct xen_vsnd_backend *xvb, int stages);
@@ -0,0 +1,61 @@
+/*
+ * cmdq.c:
+ *
+ * Command queue from the main loop to the audio thread, see cmdq.h.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "project.h"
+
+#include <stdint.h>
+#include <pthread.h>
+#include <event.h>
+
+#include "mb.h"
+#include "audio-daemon.h"
+#include "cmdq.h"
+
+/* Returns -1 if the queue is full */
+int cmdq_push(struct cmd_queue *q, const struct fe_cmd *cmd)
+{
+    uint32_t prod = q->prod;
+
+    if (prod - load_acquire(&q->cons) == CMD_QUEUE_SIZE)
+        return -1;
+
+    q->cmds[prod & (CMD_QUEUE_SIZE - 1)] = *cmd;
+    store_release(&q->prod, prod + 1);
+
+    return 0;
+}
+
+/* Returns 0 if the queue is empty */
+int cmdq_pop(struct cmd_queue *q, struct fe_cmd *cmd)
+{
+    uint32_t cons = q->cons;
+
+    if (cons == load_acquire(&q->prod))
+        return 0;
+
+    *cmd = q->cmds[cons & (CMD_QUEUE_SIZE - 1)];
+    store_release(&q->cons, cons + 1);
+
+    return 1;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _CMDQ_H_
+#define _CMDQ_H_
+
+#include <stdint.h>
+
+/*
+ * Single producer, single consumer queue of guest commands, from the
+ * main loop, which reads them off the command ring, to the audio thread,
+ * which carries them out between periods. Neither side ever waits.
+ */
+#define CMD_QUEUE_SIZE 64       /* power of 2 */
+
+struct cmd_queue {
+    struct fe_cmd cmds[CMD_QUEUE_SIZE];
+    uint32_t prod;              /* written by the main loop only */
+    uint32_t cons;              /* written by the audio thread only */
+};
+
+int cmdq_push(struct cmd_queue *q, const struct fe_cmd *cmd);
+int cmdq_pop(struct cmd_queue *q, struct fe_cmd *cmd);
+
+#endif
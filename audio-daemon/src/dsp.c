@@ -0,0 +1,282 @@
+/*
+ * dsp.c:
+ *
+ * Voice processing of the capture, see dsp.h.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+
+#include "mix.h"
+#include "dsp.h"
+
+/* Echo canceller tail, in frames */
+#define ECHO_TAIL 8192
+/* What went to the card, in frames, a power of two */
+#define DELAY_LINE_FRAMES 16384
+/* Only realign the echo reference when the delay moves by more */
+#define DELAY_SLACK 256
+
+static const struct {
+    const char *name;
+    int stage;
+} stage_names[] = {
+    { "downmix", DSP_DOWNMIX },
+    { "aec", DSP_AEC },
+    { "denoise", DSP_DENOISE },
+    { "agc", DSP_AGC },
+    { "upmix", DSP_UPMIX },
+};
+#define N_STAGE_NAMES (sizeof (stage_names) / sizeof (stage_names[0]))
+
+/*
+ * The echo canceller is shared, and runs at most once a period. The
+ * rest of the voice stages keep state, so there is a preprocessor, and
+ * a result, for each set of them a guest asks for, computed once a
+ * period for however many guests ask for it.
+ */
+static struct {
+    int rate;
+    int block;                  /* what speex works on */
+    int frames;                 /* most in a period */
+    int stages;                 /* DOWNMIX and UPMIX */
+
+    SpeexEchoState *echo;
+    SpeexPreprocessState *pre[DSP_VOICE + 1];
+    int16_t *out[DSP_VOICE + 1];
+
+    int16_t *ref;               /* mono, DELAY_LINE_FRAMES */
+    uint32_t ref_w;             /* frames that went to the card */
+    int delay;
+
+    /* The current period */
+    const int16_t *in;
+    int n;
+    int have_mono;
+    int have_clean;
+    unsigned int done;          /* out[] ready, by voice stages */
+    int16_t *mono;
+    int16_t *play;
+    int16_t *clean;
+    int16_t *voice;
+} dsp;
+
+int dsp_parse(const char *s)
+{
+    int stages = 0;
+    size_t len, i;
+
+    if (!strcmp(s, "none"))
+        return 0;
+
+    while (*s) {
+        len = strcspn(s, ",");
+        for (i = 0; i < N_STAGE_NAMES; i++)
+            if (strlen(stage_names[i].name) == len &&
+                !strncmp(s, stage_names[i].name, len))
+                break;
+        if (i == N_STAGE_NAMES)
+            return -1;
+        stages |= stage_names[i].stage;
+
+        s += len;
+        if (*s)
+            s++;
+    }
+
+    return stages;
+}
+
+int dsp_init(int rate, int block, int frames, int stages)
+{
+    if (dsp.echo)
+        return 0;
+
+    dsp.rate = rate;
+    dsp.block = block;
+    dsp.frames = frames;
+    dsp.stages = stages & (DSP_DOWNMIX | DSP_UPMIX);
+    /* Two periods, until it is measured */
+    dsp.delay = 2 * frames;
+
+    dsp.ref = calloc(DELAY_LINE_FRAMES, sizeof (int16_t));
+    dsp.mono = malloc(frames * sizeof (int16_t));
+    dsp.play = malloc(frames * sizeof (int16_t));
+    dsp.clean = malloc(frames * sizeof (int16_t));
+    dsp.voice = malloc(frames * sizeof (int16_t));
+    if (!dsp.ref || !dsp.mono || !dsp.play || !dsp.clean || !dsp.voice)
+        return -1;
+
+    dsp.echo = speex_echo_state_init(block, ECHO_TAIL);
+    if (!dsp.echo)
+        return -1;
+    speex_echo_ctl(dsp.echo, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+
+    return 0;
+}
+
+int dsp_prepare(int stages)
+{
+    int v = stages & DSP_VOICE;
+    SpeexPreprocessState *pre;
+    spx_int32_t tmp;
+
+    if (!v || dsp.pre[v])
+        return 0;
+
+    if (!dsp.out[v])
+        dsp.out[v] = malloc(dsp.frames * 2 * sizeof (int16_t));
+    if (!dsp.out[v])
+        return -1;
+
+    pre = speex_preprocess_state_init(dsp.block, dsp.rate);
+    if (!pre)
+        return -1;
+
+    tmp = !!(v & DSP_DENOISE);
+    speex_preprocess_ctl(pre, SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+    tmp = !!(v & DSP_AGC);
+    speex_preprocess_ctl(pre, SPEEX_PREPROCESS_SET_AGC, &tmp);
+
+    /* What the echo canceller leaves is suppressed here */
+    if (v & DSP_AEC) {
+        tmp = -60;
+        speex_preprocess_ctl(pre, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &tmp);
+        tmp = -60;
+        speex_preprocess_ctl(pre, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
+        speex_preprocess_ctl(pre, SPEEX_PREPROCESS_SET_ECHO_STATE, dsp.echo);
+    }
+
+    dsp.pre[v] = pre;
+    return 0;
+}
+
+void dsp_reset(void)
+{
+    speex_echo_state_reset(dsp.echo);
+}
+
+/*
+ * A frame played now is heard in the capture after the frames queued to
+ * the card, and those captured but not read yet. The echo canceller has
+ * to start over when the reference moves, so small changes are ignored.
+ */
+void dsp_set_delay(int frames)
+{
+    if (frames < 0)
+        frames = 0;
+    if (frames > DELAY_LINE_FRAMES - dsp.frames)
+        frames = DELAY_LINE_FRAMES - dsp.frames;
+
+    if (abs(frames - dsp.delay) > DELAY_SLACK) {
+        dsp.delay = frames;
+        speex_echo_state_reset(dsp.echo);
+    }
+}
+
+/* Everything that goes to the card, so the delay line stays in step */
+void dsp_reference(const int16_t *out, int frames)
+{
+    uint32_t w = dsp.ref_w & (DELAY_LINE_FRAMES - 1);
+    int first = frames;
+
+    if (first > DELAY_LINE_FRAMES - w)
+        first = DELAY_LINE_FRAMES - w;
+    mix_downmix(dsp.ref + w, out, first);
+    mix_downmix(dsp.ref, out + 2 * first, frames - first);
+    dsp.ref_w += frames;
+}
+
+void dsp_begin(const int16_t *in, int frames)
+{
+    dsp.in = in;
+    dsp.n = frames;
+    dsp.have_mono = 0;
+    dsp.have_clean = 0;
+    dsp.done = 0;
+}
+
+/* What was played dsp.delay frames before the current period */
+static void echo_reference(void)
+{
+    uint32_t r = (dsp.ref_w - dsp.delay - dsp.n) & (DELAY_LINE_FRAMES - 1);
+    int first = dsp.n;
+
+    if (first > DELAY_LINE_FRAMES - r)
+        first = DELAY_LINE_FRAMES - r;
+    memcpy(dsp.play, dsp.ref + r, first * sizeof (int16_t));
+    memcpy(dsp.play + first, dsp.ref, (dsp.n - first) * sizeof (int16_t));
+}
+
+const int16_t *dsp_capture(int stages)
+{
+    int v = stages & DSP_VOICE;
+    const int16_t *src;
+    int16_t *out;
+    int i;
+
+    /* Speex works on whole blocks of the size it was set up with */
+    if (!v || !dsp.pre[v] || dsp.n > dsp.frames || dsp.n % dsp.block)
+        return dsp.in;
+    out = dsp.out[v];
+    if (dsp.done & (1 << v))
+        return out;
+
+    if (!dsp.have_mono) {
+        if (dsp.stages & DSP_DOWNMIX)
+            mix_downmix(dsp.mono, dsp.in, dsp.n);
+        else
+            for (i = 0; i < dsp.n; i++)
+                dsp.mono[i] = dsp.in[2 * i];
+        dsp.have_mono = 1;
+    }
+    src = dsp.mono;
+
+    if (v & DSP_AEC) {
+        if (!dsp.have_clean) {
+            echo_reference();
+            for (i = 0; i < dsp.n; i += dsp.block)
+                speex_echo_cancellation(dsp.echo, dsp.mono + i, dsp.play + i,
+                                        dsp.clean + i);
+            dsp.have_clean = 1;
+        }
+        src = dsp.clean;
+    }
+
+    memcpy(dsp.voice, src, dsp.n * sizeof (int16_t));
+    for (i = 0; i < dsp.n; i += dsp.block)
+        speex_preprocess_run(dsp.pre[v], dsp.voice + i);
+
+    if (dsp.stages & DSP_UPMIX) {
+        mix_upmix(out, dsp.voice, dsp.n);
+    } else {
+        for (i = 0; i < dsp.n; i++) {
+            out[2 * i] = dsp.voice[i];
+            out[2 * i + 1] = dsp.in[2 * i + 1];
+        }
+    }
+
+    dsp.done |= 1 << v;
+    return out;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include <stdint.h>
+
+/*
+ * Voice processing of the captured periods, in stages that can each be
+ * bypassed. The voice stages (AEC, DENOISE, AGC) run on mono, and are
+ * chosen per guest: a guest with none of them gets the capture as is,
+ * and costs nothing. DOWNMIX and UPMIX are how the card's stereo gets in
+ * and out of mono, for all the guests: without DOWNMIX only the left
+ * channel is used, without UPMIX only the left channel gets the result.
+ */
+#define DSP_DOWNMIX (1 << 0)
+#define DSP_AEC     (1 << 1)
+#define DSP_DENOISE (1 << 2)
+#define DSP_AGC     (1 << 3)
+#define DSP_UPMIX   (1 << 4)
+
+#define DSP_VOICE (DSP_AEC | DSP_DENOISE | DSP_AGC)
+#define DSP_ALL (DSP_DOWNMIX | DSP_VOICE | DSP_UPMIX)
+
+/* Stages from "aec,denoise,...", or "none", -1 if one is unknown */
+int dsp_parse(const char *s);
+
+/*
+ * Once, with the stages of the card, before anything else. Periods are
+ * up to frames long, and processed in blocks, which they are multiples
+ * of.
+ */
+int dsp_init(int rate, int block, int frames, int stages);
+/* From the main loop, after dsp_init, before a guest gets these stages */
+int dsp_prepare(int stages);
+
+/*
+ * From the audio thread. The echo canceller needs all that goes to the
+ * card (dsp_reference), and the delay from there to the capture, in
+ * frames (dsp_set_delay). Restart it with dsp_reset after a pause.
+ */
+void dsp_reset(void);
+void dsp_set_delay(int frames);
+void dsp_reference(const int16_t *out, int frames);
+
+/* A new captured period, then what each guest gets of it */
+void dsp_begin(const int16_t *in, int frames);
+const int16_t *dsp_capture(int stages);
+
+#endif
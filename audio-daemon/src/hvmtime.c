@@ -0,0 +1,190 @@
+/*
+ * hvmtime.c:
+ *
+ * Timestamps in the HVM time base from CLOCK_MONOTONIC_RAW, see hvmtime.h.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "mb.h"
+#include "hvmtime.h"
+
+/*
+ * The time base at raw, and its rate against CLOCK_MONOTONIC_RAW from
+ * there. Written by the main loop, read from any thread under a
+ * sequence count: odd while it changes, readers retry on a change.
+ */
+static struct {
+    unsigned int seq;
+    int valid;
+    uint64_t raw;
+    uint64_t base;
+    int64_t ppb;
+} model;
+
+static int (*read_base)(uint64_t *now);
+static struct hvmtime_stats stats;
+/* The last calibration, to measure the rate from */
+static uint64_t last_raw, last_base;
+
+static uint64_t raw_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t predict(uint64_t raw, uint64_t ref_raw, uint64_t base,
+                        int64_t ppb)
+{
+    int64_t d = raw - ref_raw;
+
+    return base + d + d * ppb / 1000000000;
+}
+
+static int64_t clamp_ppb(int64_t ppb)
+{
+    if (ppb > HVMTIME_MAX_PPB)
+        return HVMTIME_MAX_PPB;
+    if (ppb < -HVMTIME_MAX_PPB)
+        return -HVMTIME_MAX_PPB;
+    return ppb;
+}
+
+static void publish(uint64_t raw, uint64_t base, int64_t ppb)
+{
+    unsigned int seq = model.seq;
+
+    store_release(&model.seq, seq + 1);
+    fence_release();
+    model.raw = raw;
+    model.base = base;
+    model.ppb = ppb;
+    model.valid = 1;
+    store_release(&model.seq, seq + 2);
+}
+
+uint64_t hvmtime_now(void)
+{
+    uint64_t raw, ref_raw, base, now;
+    unsigned int seq;
+    int64_t ppb;
+    int valid;
+
+    raw = raw_now();
+    do {
+        seq = load_acquire(&model.seq);
+        valid = model.valid;
+        ref_raw = model.raw;
+        base = model.base;
+        ppb = model.ppb;
+        fence_acquire();
+    } while ((seq & 1) || seq != __atomic_load_n(&model.seq, __ATOMIC_RELAXED));
+
+    if (!valid) {
+        read_base(&now);
+        return now;
+    }
+
+    return predict(raw, ref_raw, base, ppb);
+}
+
+/* The quickest of a few reads, at the middle of the raw clock around it */
+static int sample(uint64_t *raw, uint64_t *base, uint64_t *uncertainty)
+{
+    uint64_t before, after, now, best = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < HVMTIME_SAMPLES; i++) {
+        before = raw_now();
+        if (read_base(&now))
+            continue;
+        after = raw_now();
+        if (after - before < best) {
+            best = after - before;
+            *raw = before + best / 2;
+            *base = now;
+        }
+    }
+    if (best == UINT64_MAX)
+        return -1;
+
+    *uncertainty = best / 2;
+    return 0;
+}
+
+int hvmtime_calibrate(void)
+{
+    uint64_t raw, base, uncertainty, predicted;
+    int64_t error, interval, ppb = model.ppb;
+
+    if (sample(&raw, &base, &uncertainty) ||
+        uncertainty > HVMTIME_MAX_UNCERTAINTY_NS) {
+        stats.failures++;
+        return -1;
+    }
+    stats.calibrations++;
+    stats.uncertainty = uncertainty;
+
+    if (!model.valid) {
+        publish(raw, base, 0);
+        last_raw = raw;
+        last_base = base;
+        return 0;
+    }
+
+    predicted = predict(raw, model.raw, model.base, model.ppb);
+    error = base - predicted;
+    stats.error = error;
+    if (error > stats.max_error || -error > stats.max_error)
+        stats.max_error = error < 0 ? -error : error;
+
+    /* The rate over the interval, for the next, assumed as long */
+    interval = raw - last_raw;
+    if (interval > 0)
+        ppb = clamp_ppb(((int64_t)(base - last_base) - interval) *
+                        1000000000 / interval);
+    stats.ppb = ppb;
+    last_raw = raw;
+    last_base = base;
+
+    if (error > HVMTIME_STEP_NS || error < -HVMTIME_STEP_NS || interval <= 0)
+        publish(raw, base, ppb);
+    else
+        publish(raw, predicted,
+                clamp_ppb(ppb + error * 1000000000 / interval));
+
+    return 0;
+}
+
+int hvmtime_init(int (*read)(uint64_t *now))
+{
+    read_base = read;
+    return hvmtime_calibrate();
+}
+
+void hvmtime_get_stats(struct hvmtime_stats *st)
+{
+    *st = stats;
+}
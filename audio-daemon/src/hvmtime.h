@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _HVMTIME_H_
+#define _HVMTIME_H_
+
+#include <stdint.h>
+
+/*
+ * The HVM time base (Xen system time, in ns) that the guests read in
+ * be_info, without a hypercall each time: it is read now and then, with
+ * CLOCK_MONOTONIC_RAW on either side, and followed in between from
+ * CLOCK_MONOTONIC_RAW, at the rate measured over the last interval. The
+ * error found at each calibration is slewed away over the next
+ * interval, so timestamps never step back, unless it is over
+ * HVMTIME_STEP_NS.
+ */
+#define HVMTIME_CALIBRATE_MS    10000
+/* Reads of the time base per calibration, the quickest one is kept */
+#define HVMTIME_SAMPLES         8
+/* A read taking longer than twice this is not trusted */
+#define HVMTIME_MAX_UNCERTAINTY_NS 20000
+#define HVMTIME_STEP_NS         1000000
+/* Worth a word in the log */
+#define HVMTIME_WARN_NS         10000
+#define HVMTIME_MAX_PPB         1000000
+
+struct hvmtime_stats {
+    uint64_t calibrations;
+    uint64_t failures;          /* reads too slow, or failed */
+    int64_t error;              /* ns, at the last calibration */
+    int64_t max_error;          /* largest, either way */
+    uint64_t uncertainty;       /* ns, of the last calibration */
+    int64_t ppb;                /* of the time base against ours */
+};
+
+/*
+ * With the hypercall reading the time base, which hvmtime_now() also
+ * falls back to until a calibration succeeds. Returns -1 if the first
+ * one failed.
+ */
+int hvmtime_init(int (*read)(uint64_t *now));
+/* From the main loop, every HVMTIME_CALIBRATE_MS */
+int hvmtime_calibrate(void);
+/* From any thread */
+uint64_t hvmtime_now(void);
+void hvmtime_get_stats(struct hvmtime_stats *st);
+
+#endif
@@ -31,4 +31,10 @@
 #error "Unknow architecture"
 #endif
 
+/* For indexes and state shared by two threads without a lock */
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define fence_acquire()     __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fence_release()     __atomic_thread_fence(__ATOMIC_RELEASE)
+
 #endif
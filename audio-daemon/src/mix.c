@@ -0,0 +1,194 @@
+/*
+ * mix.c:
+ *
+ * Playback mixer for the guests sharing the sound card.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "mix.h"
+
+void mix_clear(int32_t *acc, size_t n)
+{
+    memset(acc, 0, n * sizeof (*acc));
+}
+
+/* acc[i] += src[i] * gain / 100, with the same Q15 gain as pcm_copy_gain() */
+void mix_add(int32_t *acc, const int16_t *src, size_t n, int gain)
+{
+    int32_t g;
+    size_t i = 0;
+
+    if (gain > PCM_GAIN_UNITY)
+        gain = PCM_GAIN_UNITY;
+    if (gain <= 0)
+        return;
+    g = gain * 32768 / PCM_GAIN_UNITY;
+
+#if defined(__AVX2__)
+    {
+        __m256i vg = _mm256_set1_epi32(g);
+
+        for (; i + 8 <= n; i += 8) {
+            __m256i s = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+            __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+
+            if (gain < PCM_GAIN_UNITY)
+                s = _mm256_srai_epi32(_mm256_mullo_epi32(s, vg), 15);
+            _mm256_storeu_si256((__m256i *)(acc + i), _mm256_add_epi32(a, s));
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i vg = _mm_set1_epi16(g);
+
+        for (; i + 8 <= n; i += 8) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(acc + i));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+            __m128i p0, p1;
+
+            if (gain < PCM_GAIN_UNITY) {
+                __m128i lo = _mm_mullo_epi16(s, vg);
+                __m128i hi = _mm_mulhi_epi16(s, vg);
+
+                p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+                p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+            } else {
+                /* Sign extension: the sample in the top half, shifted down */
+                p0 = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+                p1 = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+            }
+            _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi32(a0, p0));
+            _mm_storeu_si128((__m128i *)(acc + i + 4), _mm_add_epi32(a1, p1));
+        }
+    }
+#endif
+
+    if (gain < PCM_GAIN_UNITY)
+        for (; i < n; i++)
+            acc[i] += (src[i] * g) >> 15;
+    else
+        for (; i < n; i++)
+            acc[i] += src[i];
+}
+
+void mix_out(int16_t *dst, const int32_t *acc, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + i + 8));
+
+        /* packs works within 128 bit lanes, put the quadwords back in order */
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), 0xd8));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(acc + i + 4));
+
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a0, a1));
+    }
+#endif
+
+    for (; i < n; i++) {
+        if (acc[i] > INT16_MAX)
+            dst[i] = INT16_MAX;
+        else if (acc[i] < INT16_MIN)
+            dst[i] = INT16_MIN;
+        else
+            dst[i] = acc[i];
+    }
+}
+
+void mix_downmix(int16_t *mono, const int16_t *stereo, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i one = _mm256_set1_epi16(1);
+
+        for (; i + 16 <= n; i += 16) {
+            __m256i s0 = _mm256_loadu_si256((const __m256i *)(stereo + 2 * i));
+            __m256i s1 = _mm256_loadu_si256((const __m256i *)(stereo + 2 * i + 16));
+            /* Left + right of each frame, in 32 bits so it cannot wrap */
+            __m256i a0 = _mm256_srai_epi32(_mm256_madd_epi16(s0, one), 1);
+            __m256i a1 = _mm256_srai_epi32(_mm256_madd_epi16(s1, one), 1);
+
+            _mm256_storeu_si256((__m256i *)(mono + i),
+                                _mm256_permute4x64_epi64(_mm256_packs_epi32(a0, a1), 0xd8));
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i one = _mm_set1_epi16(1);
+
+        for (; i + 8 <= n; i += 8) {
+            __m128i s0 = _mm_loadu_si128((const __m128i *)(stereo + 2 * i));
+            __m128i s1 = _mm_loadu_si128((const __m128i *)(stereo + 2 * i + 8));
+            __m128i a0 = _mm_srai_epi32(_mm_madd_epi16(s0, one), 1);
+            __m128i a1 = _mm_srai_epi32(_mm_madd_epi16(s1, one), 1);
+
+            _mm_storeu_si128((__m128i *)(mono + i), _mm_packs_epi32(a0, a1));
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+        mono[i] = (stereo[2 * i] + stereo[2 * i + 1]) >> 1;
+}
+
+void mix_upmix(int16_t *stereo, const int16_t *mono, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        /* unpack works within 128 bit lanes, pair the quadwords up first */
+        __m256i m = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i *)(mono + i)), 0xd8);
+
+        _mm256_storeu_si256((__m256i *)(stereo + 2 * i), _mm256_unpacklo_epi16(m, m));
+        _mm256_storeu_si256((__m256i *)(stereo + 2 * i + 16), _mm256_unpackhi_epi16(m, m));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i m = _mm_loadu_si128((const __m128i *)(mono + i));
+
+        _mm_storeu_si128((__m128i *)(stereo + 2 * i), _mm_unpacklo_epi16(m, m));
+        _mm_storeu_si128((__m128i *)(stereo + 2 * i + 8), _mm_unpackhi_epi16(m, m));
+    }
+#endif
+
+    for (; i < n; i++)
+        stereo[2 * i] = stereo[2 * i + 1] = mono[i];
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _MIX_H_
+#define _MIX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sgcopy.h"
+
+/*
+ * Mixing of the guests' playback streams: each one is added to an int32
+ * accumulator with its own gain (in percent, see pcm_copy_gain()), and
+ * the sum is saturated back to S16 once.
+ */
+void mix_clear(int32_t *acc, size_t n);
+void mix_add(int32_t *acc, const int16_t *src, size_t n, int gain);
+void mix_out(int16_t *dst, const int32_t *acc, size_t n);
+
+/*
+ * Between interleaved stereo and mono, n frames: the downmix is the
+ * average of the channels, rounded down, the upmix copies mono to both.
+ */
+void mix_downmix(int16_t *mono, const int16_t *stereo, size_t n);
+void mix_upmix(int16_t *stereo, const int16_t *mono, size_t n);
+
+#endif
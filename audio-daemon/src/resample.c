@@ -0,0 +1,434 @@
+/*
+ * resample.c:
+ *
+ * Polyphase sample rate conversion between the guests and the sound card.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "resample.h"
+
+/* Most taps per phase, when the taps are stretched for decimation */
+#define MAX_TAPS 256
+/* Fewest phases, for the positions in between when the ratio is adjusted */
+#define MIN_PHASES 256
+
+/*
+ * Conversion by L/M: the input is upsampled by L, low-pass filtered and
+ * decimated by M, and only the outputs are ever computed. Output k
+ * comes from phase (k * M) % L of the filter, applied to the taps input
+ * frames up to (k * M) / L. The phases are stored in reverse so each
+ * output is a plain dot product over the history of each channel.
+ *
+ * The filter is designed with a multiple of L phases, at least
+ * MIN_PHASES, and positions are kept in 1/65536 of a phase. At the exact
+ * ratio they always fall on a phase. Once the ratio is adjusted they
+ * fall in between, and the output is interpolated from the phases on
+ * either side; an extra phase past the last, phase 0 a frame later,
+ * saves looking ahead.
+ */
+struct resampler {
+    int l;
+    int m;
+    int phases;                 /* a multiple of l */
+    int step;                   /* input frames per output, and the rest */
+    int step_phase;             /* in Q16 phases */
+    int taps;
+    int16_t *coefs;             /* phases + 1 of taps, Q14, aligned */
+    int phase;                  /* of the next output, Q16 */
+    int pos;                    /* newest input frame of the next output */
+    int len;                    /* frames in the history */
+    int16_t *hist[2];           /* taps - 1 + RESAMPLE_MAX_FRAMES */
+};
+
+static const struct {
+    int taps;
+    double rolloff;             /* cutoff, relative to the lower Nyquist */
+    double beta;                /* Kaiser window */
+} quality_levels[] = {
+    [RESAMPLE_QUALITY_LOW] = { 16, 0.85, 6.0 },
+    [RESAMPLE_QUALITY_MEDIUM] = { 32, 0.90, 8.0 },
+    [RESAMPLE_QUALITY_HIGH] = { 64, 0.94, 10.0 },
+};
+
+static int gcd(int a, int b)
+{
+    int t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Modified Bessel function of the first kind, order 0 */
+static double bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+
+    for (k = 1; k < 50 && term > sum * 1e-12; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/*
+ * Kaiser windowed sinc over the phases * taps prototype, split in
+ * phases. Each phase is scaled to a DC gain of exactly one after
+ * rounding, so a constant input gives a constant output whatever the
+ * phase, or the interpolation between two.
+ *
+ * The coefficients are Q14: the ripples of the sinc take the gain of a
+ * phase to a full scale input of matching signs past one (up to about
+ * 1.17 with the longest filters), and in Q15 the sums could overflow the
+ * 32 bit accumulators. In Q14 they stay under 2^30.
+ */
+static void design_filter(struct resampler *rs, double rolloff, double beta)
+{
+    int k = rs->phases / rs->l;
+    int n = rs->phases * rs->taps;
+    double fc = rolloff * 0.5 / (rs->l > rs->m ? rs->l : rs->m) / k;
+    double c = (n - 1) / 2.0;
+    double h[MAX_TAPS];
+    double sum, x, w;
+    int p, t, i, total, peak;
+
+    for (p = 0; p <= rs->phases; p++) {
+        sum = 0;
+        for (t = 0; t < rs->taps; t++) {
+            i = p + rs->phases * t;
+            x = 2 * fc * (i - c);
+            w = (i - c) / c;
+            /* The extra phase runs one off the end of the prototype */
+            h[t] = i >= n ? 0 : 2 * fc *
+                (x == 0 ? 1.0 : sin(M_PI * x) / (M_PI * x)) *
+                bessel_i0(beta * sqrt(1 - w * w)) / bessel_i0(beta);
+            sum += h[t];
+        }
+
+        total = 0;
+        peak = 0;
+        for (t = 0; t < rs->taps; t++) {
+            i = (int)lrint(h[t] / sum * 16384);
+            if (i > INT16_MAX)
+                i = INT16_MAX;
+            rs->coefs[p * rs->taps + rs->taps - 1 - t] = i;
+            total += i;
+            if (h[t] > h[peak])
+                peak = t;
+        }
+        rs->coefs[p * rs->taps + rs->taps - 1 - peak] += 16384 - total;
+    }
+}
+
+struct resampler *resampler_new(int in_rate, int out_rate, int quality)
+{
+    struct resampler *rs;
+    int g, taps;
+
+    if (in_rate <= 0 || out_rate <= 0 ||
+        quality < RESAMPLE_QUALITY_LOW || quality > RESAMPLE_QUALITY_HIGH)
+        return NULL;
+
+    rs = calloc(1, sizeof (*rs));
+    if (!rs)
+        return NULL;
+
+    g = gcd(in_rate, out_rate);
+    rs->l = out_rate / g;
+    rs->m = in_rate / g;
+    if (rs->l > RESAMPLE_MAX_PHASES)
+        goto fail;
+    rs->phases = rs->l * ((MIN_PHASES + rs->l - 1) / rs->l);
+
+    /* Stretch the filter when decimating, so it keeps its sharpness */
+    taps = quality_levels[quality].taps;
+    if (rs->m > rs->l)
+        taps = (taps * rs->m / rs->l + 15) & ~15;
+    if (taps > MAX_TAPS)
+        taps = MAX_TAPS;
+    rs->taps = taps;
+
+    if (posix_memalign((void **)&rs->coefs, 32,
+                       (rs->phases + 1) * rs->taps * sizeof (*rs->coefs)))
+        goto fail;
+    rs->hist[0] = calloc(taps - 1 + RESAMPLE_MAX_FRAMES, sizeof (int16_t));
+    rs->hist[1] = calloc(taps - 1 + RESAMPLE_MAX_FRAMES, sizeof (int16_t));
+    if (!rs->hist[0] || !rs->hist[1])
+        goto fail;
+
+    design_filter(rs, quality_levels[quality].rolloff,
+                  quality_levels[quality].beta);
+    resampler_reset(rs);
+
+    return rs;
+
+fail:
+    resampler_free(rs);
+    return NULL;
+}
+
+void resampler_free(struct resampler *rs)
+{
+    if (!rs)
+        return;
+    free(rs->coefs);
+    free(rs->hist[0]);
+    free(rs->hist[1]);
+    free(rs);
+}
+
+/* Back to silence and the exact ratio, as if just created */
+void resampler_reset(struct resampler *rs)
+{
+    memset(rs->hist[0], 0, (rs->taps - 1) * sizeof (int16_t));
+    memset(rs->hist[1], 0, (rs->taps - 1) * sizeof (int16_t));
+    rs->len = rs->taps - 1;
+    rs->pos = rs->taps - 1;
+    rs->phase = 0;
+    resampler_adjust(rs, 0);
+}
+
+/*
+ * The step per output is m / l input frames, m * phases / l phases,
+ * which is a whole number of them at the exact ratio.
+ */
+void resampler_adjust(struct resampler *rs, double ratio)
+{
+    int64_t one = (int64_t)rs->phases << 16;
+    int64_t step = (int64_t)rs->m * (rs->phases / rs->l) << 16;
+
+    if (ratio > RESAMPLE_MAX_ADJUST)
+        ratio = RESAMPLE_MAX_ADJUST;
+    if (ratio < -RESAMPLE_MAX_ADJUST)
+        ratio = -RESAMPLE_MAX_ADJUST;
+    step += llrint(step * ratio);
+
+    rs->step = step / one;
+    rs->step_phase = step % one;
+}
+
+int resampler_need(const struct resampler *rs, int out_frames)
+{
+    int64_t one = (int64_t)rs->phases << 16;
+    int64_t step = rs->step * one + rs->step_phase;
+    int64_t last;
+
+    if (out_frames <= 0)
+        return 0;
+
+    last = rs->pos + (rs->phase + (out_frames - 1) * step) / one;
+    return last < rs->len ? 0 : last + 1 - rs->len;
+}
+
+int resampler_push(struct resampler *rs, const int16_t *in, int frames)
+{
+    int base = rs->pos - (rs->taps - 1);
+    int room, i;
+
+    /* Drop what no output needs any more */
+    if (base > 0) {
+        memmove(rs->hist[0], rs->hist[0] + base,
+                (rs->len - base) * sizeof (int16_t));
+        memmove(rs->hist[1], rs->hist[1] + base,
+                (rs->len - base) * sizeof (int16_t));
+        rs->len -= base;
+        rs->pos -= base;
+    }
+
+    room = rs->taps - 1 + RESAMPLE_MAX_FRAMES - rs->len;
+    if (frames > room)
+        frames = room;
+
+    for (i = 0; i < frames; i++) {
+        rs->hist[0][rs->len + i] = in[2 * i];
+        rs->hist[1][rs->len + i] = in[2 * i + 1];
+    }
+    rs->len += frames;
+
+    return frames;
+}
+
+/*
+ * Both channels against one phase. The taps are a multiple of 16, and
+ * pmaddwd cannot overflow as the coefficients stay below 32768, nor can
+ * the sums of a phase, see design_filter().
+ */
+static inline void dot2(const int16_t *l, const int16_t *r, const int16_t *h,
+                        int taps, int32_t *out_l, int32_t *out_r)
+{
+    int32_t sl = 0, sr = 0;
+    int i = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i al = _mm256_setzero_si256();
+        __m256i ar = _mm256_setzero_si256();
+        __m128i s;
+
+        for (; i + 16 <= taps; i += 16) {
+            __m256i hv = _mm256_load_si256((const __m256i *)(h + i));
+
+            al = _mm256_add_epi32(al, _mm256_madd_epi16(
+                _mm256_loadu_si256((const __m256i *)(l + i)), hv));
+            ar = _mm256_add_epi32(ar, _mm256_madd_epi16(
+                _mm256_loadu_si256((const __m256i *)(r + i)), hv));
+        }
+        /* Sum the lanes, left in the low half and right in the high */
+        al = _mm256_hadd_epi32(al, ar);
+        al = _mm256_hadd_epi32(al, al);
+        s = _mm_add_epi32(_mm256_castsi256_si128(al),
+                          _mm256_extracti128_si256(al, 1));
+        sl = _mm_cvtsi128_si32(s);
+        sr = _mm_cvtsi128_si32(_mm_srli_si128(s, 4));
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i al = _mm_setzero_si128();
+        __m128i ar = _mm_setzero_si128();
+
+        for (; i + 8 <= taps; i += 8) {
+            __m128i hv = _mm_load_si128((const __m128i *)(h + i));
+
+            al = _mm_add_epi32(al, _mm_madd_epi16(
+                _mm_loadu_si128((const __m128i *)(l + i)), hv));
+            ar = _mm_add_epi32(ar, _mm_madd_epi16(
+                _mm_loadu_si128((const __m128i *)(r + i)), hv));
+        }
+        al = _mm_add_epi32(al, _mm_srli_si128(al, 8));
+        al = _mm_add_epi32(al, _mm_srli_si128(al, 4));
+        ar = _mm_add_epi32(ar, _mm_srli_si128(ar, 8));
+        ar = _mm_add_epi32(ar, _mm_srli_si128(ar, 4));
+        sl = _mm_cvtsi128_si32(al);
+        sr = _mm_cvtsi128_si32(ar);
+    }
+#endif
+
+    for (; i < taps; i++) {
+        sl += l[i] * h[i];
+        sr += r[i] * h[i];
+    }
+    *out_l = sl;
+    *out_r = sr;
+}
+
+static inline int16_t q14_to_s16(int32_t v)
+{
+    v = (v + (1 << 13)) >> 14;
+    if (v > INT16_MAX)
+        return INT16_MAX;
+    if (v < INT16_MIN)
+        return INT16_MIN;
+    return v;
+}
+
+int resampler_pull(struct resampler *rs, int16_t *out, int frames)
+{
+    const int16_t *h;
+    int32_t l, r, l1, r1;
+    int base, frac, n;
+
+    for (n = 0; n < frames && rs->pos < rs->len; n++) {
+        base = rs->pos - (rs->taps - 1);
+        h = rs->coefs + (rs->phase >> 16) * rs->taps;
+        dot2(rs->hist[0] + base, rs->hist[1] + base, h, rs->taps, &l, &r);
+        frac = rs->phase & 0xffff;
+        if (frac) {
+            dot2(rs->hist[0] + base, rs->hist[1] + base, h + rs->taps,
+                 rs->taps, &l1, &r1);
+            l += (((int64_t)l1 - l) * frac) >> 16;
+            r += (((int64_t)r1 - r) * frac) >> 16;
+        }
+        out[2 * n] = q14_to_s16(l);
+        out[2 * n + 1] = q14_to_s16(r);
+
+        rs->pos += rs->step;
+        rs->phase += rs->step_phase;
+        if (rs->phase >= rs->phases << 16) {
+            rs->phase -= rs->phases << 16;
+            rs->pos++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * The phases used at the exact ratio are multiples of phases / l. The
+ * output with the one of largest gain is found by stepping from a reset
+ * resampler, far enough in that its taps are all past the initial
+ * silence, and the input under them is set to full scale with the signs
+ * of the coefficients.
+ */
+int resampler_worst_case(const struct resampler *rs, int16_t *in, int frames)
+{
+    int64_t gain, worst_gain = -1;
+    int p, t, n, pos, phase, worst = 0, base;
+    const int16_t *h;
+
+    for (p = 0; p < rs->phases; p += rs->phases / rs->l) {
+        gain = 0;
+        for (t = 0; t < rs->taps; t++)
+            gain += abs(rs->coefs[p * rs->taps + t]);
+        if (gain > worst_gain) {
+            worst_gain = gain;
+            worst = p;
+        }
+    }
+
+    pos = rs->taps - 1;
+    phase = 0;
+    for (n = 0; ; n++) {
+        if (pos >= 2 * (rs->taps - 1) && phase >> 16 == worst)
+            break;
+        pos += rs->step;
+        phase += rs->step_phase;
+        if (phase >= rs->phases << 16) {
+            phase -= rs->phases << 16;
+            pos++;
+        }
+        if (pos - (rs->taps - 1) >= frames)
+            return -1;
+    }
+
+    /* History frame i is input frame i - (taps - 1) */
+    memset(in, 0, frames * 2 * sizeof (*in));
+    base = pos - 2 * (rs->taps - 1);
+    h = rs->coefs + worst * rs->taps;
+    for (t = 0; t < rs->taps; t++) {
+        in[2 * (base + t)] = h[t] < 0 ? INT16_MIN : INT16_MAX;
+        in[2 * (base + t) + 1] = h[t] < 0 ? INT16_MAX : INT16_MIN;
+    }
+
+    return n;
+}
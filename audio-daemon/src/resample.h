@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+/*
+ * Polyphase resampling of S16 stereo between two rates in a ratio of
+ * small integers (at most RESAMPLE_MAX_PHASES filter phases). The
+ * quality sets the taps per phase, and how sharp the filter is.
+ */
+#define RESAMPLE_QUALITY_LOW 0          /* 16 taps */
+#define RESAMPLE_QUALITY_MEDIUM 1       /* 32 taps */
+#define RESAMPLE_QUALITY_HIGH 2         /* 64 taps */
+#define RESAMPLE_QUALITY_DEFAULT RESAMPLE_QUALITY_MEDIUM
+
+#define RESAMPLE_MAX_PHASES 1024
+/* Most frames pushed in at once */
+#define RESAMPLE_MAX_FRAMES 4096
+/* Furthest the ratio can be adjusted from the exact one */
+#define RESAMPLE_MAX_ADJUST 0.01
+
+struct resampler;
+
+struct resampler *resampler_new(int in_rate, int out_rate, int quality);
+void resampler_free(struct resampler *rs);
+void resampler_reset(struct resampler *rs);
+/*
+ * Take ratio more input per output than the exact in_rate / out_rate,
+ * or less if negative, to follow a clock drifting from its nominal
+ * rate. The output is interpolated between filter phases while it is
+ * not 0.
+ */
+void resampler_adjust(struct resampler *rs, double ratio);
+
+/* Input frames to push before out_frames can be pulled */
+int resampler_need(const struct resampler *rs, int out_frames);
+/* Returns the frames taken, fewer than asked if there is no room */
+int resampler_push(struct resampler *rs, const int16_t *in, int frames);
+/* Returns the frames produced, fewer than asked once the input runs out */
+int resampler_pull(struct resampler *rs, int16_t *out, int frames);
+
+/*
+ * For tests, with a resampler just created or reset: fill frames of in
+ * with the full scale input that takes an output furthest past full
+ * scale, positive on the left and negative on the right, and return
+ * which output that is, -1 if frames is too short.
+ */
+int resampler_worst_case(const struct resampler *rs, int16_t *in, int frames);
+
+#endif
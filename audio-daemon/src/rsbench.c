@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * rsbench: time the resampler, for a card period of output.
+ *
+ * Converts between 44100Hz and 48000Hz both ways, and from 48000Hz to
+ * itself, at each quality, at the exact ratio and adjusted by ADJUST as
+ * for drift compensation, and prints the time to produce PERIOD_FRAMES
+ * frames, as the audio thread does once per period and guest. The
+ * output of a constant input is checked to be that constant, whatever
+ * the phase, and a full scale input with the signs of the coefficients
+ * of the phase with the most gain is checked to clip, not wrap.
+ *
+ * usage: rsbench [periods]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+
+#include "resample.h"
+
+#define PERIOD_FRAMES 1024
+#define DC 12345
+#define ADJUST 300e-6
+
+static int16_t in[RESAMPLE_MAX_FRAMES * 2];
+static int16_t out[RESAMPLE_MAX_FRAMES * 2];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill(int dc)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < RESAMPLE_MAX_FRAMES * 2; i++)
+        in[i] = dc ? DC : (int16_t)(8000 * sin(i * 0.01) + rand() % 1000);
+}
+
+/* One period out, as the playback path does it */
+static int period(struct resampler *rs)
+{
+    int need = resampler_need(rs, PERIOD_FRAMES);
+
+    if (resampler_push(rs, in, need) != need ||
+        resampler_pull(rs, out, PERIOD_FRAMES) != PERIOD_FRAMES)
+        return -1;
+    return 0;
+}
+
+static int verify(int in_rate, int out_rate, int quality, double adjust)
+{
+    struct resampler *rs;
+    int i, j;
+
+    rs = resampler_new(in_rate, out_rate, quality);
+    if (!rs)
+        return -1;
+    resampler_adjust(rs, adjust);
+
+    fill(1);
+    /* The first periods still have the silence it started from */
+    for (i = 0; i < 4; i++)
+        if (period(rs))
+            return -1;
+    for (j = 0; j < PERIOD_FRAMES * 2; j++)
+        if (out[j] != DC)
+            return -1;
+
+    resampler_free(rs);
+    return 0;
+}
+
+static int verify_full_scale(int in_rate, int out_rate, int quality)
+{
+    struct resampler *rs;
+    int n, need;
+
+    rs = resampler_new(in_rate, out_rate, quality);
+    if (!rs)
+        return -1;
+
+    n = resampler_worst_case(rs, in, RESAMPLE_MAX_FRAMES);
+    if (n < 0)
+        return -1;
+    need = resampler_need(rs, n + 1);
+    if (resampler_push(rs, in, need) != need ||
+        resampler_pull(rs, out, n + 1) != n + 1)
+        return -1;
+    if (out[2 * n] != INT16_MAX || out[2 * n + 1] != INT16_MIN)
+        return -1;
+
+    resampler_free(rs);
+    return 0;
+}
+
+static double run(int in_rate, int out_rate, int quality, double adjust,
+                  unsigned long periods)
+{
+    struct resampler *rs;
+    unsigned long i;
+    uint64_t start;
+
+    rs = resampler_new(in_rate, out_rate, quality);
+    if (!rs)
+        return -1;
+    resampler_adjust(rs, adjust);
+
+    fill(0);
+    start = now_ns();
+    for (i = 0; i < periods; i++)
+        if (period(rs))
+            return -1;
+
+    resampler_free(rs);
+    return (double)(now_ns() - start) / periods;
+}
+
+int main(int argc, char **argv)
+{
+    static const int rates[][2] = {
+        { 44100, 48000 }, { 48000, 44100 }, { 48000, 48000 }
+    };
+    unsigned long periods = 20000;
+    double ns, adjust;
+    int q, r, a;
+
+    if (argc > 1)
+        periods = strtoul(argv[1], NULL, 0);
+    if (!periods) {
+        fprintf(stderr, "usage: %s [periods]\n", argv[0]);
+        return 1;
+    }
+
+    for (q = RESAMPLE_QUALITY_LOW; q <= RESAMPLE_QUALITY_HIGH; q++) {
+        for (r = 0; r < 3; r++) {
+            if (verify_full_scale(rates[r][0], rates[r][1], q)) {
+                fprintf(stderr, "%d to %d, quality %d: full scale wraps\n",
+                        rates[r][0], rates[r][1], q);
+                return 1;
+            }
+            for (a = 0; a < 2; a++) {
+                adjust = a ? ADJUST : 0;
+                if (verify(rates[r][0], rates[r][1], q, adjust)) {
+                    fprintf(stderr, "%d to %d, quality %d%s: wrong DC gain\n",
+                            rates[r][0], rates[r][1], q,
+                            a ? ", adjusted" : "");
+                    return 1;
+                }
+                ns = run(rates[r][0], rates[r][1], q, adjust, periods);
+                if (ns < 0)
+                    return 1;
+                printf("%5d to %5d, quality %d%s: %8.0f ns/period\n",
+                       rates[r][0], rates[r][1], q,
+                       a ? ", adjusted" : "         ", ns);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * sgbench: cost of moving one period between ALSA and the guest pages.
+ *
+ * Copies periods of PERIOD_FRAMES stereo S16 frames out of and into a
+ * ring of N_PAGES pages, the way the capture callback does, once with the
+ * former sample by sample loop over the pages and once with sg_read() and
+ * sg_write() over the ring mapped contiguously, at unity gain and at the
+ * given gain, and prints the time per period of each. The ring pointer
+ * starts off a page boundary so periods straddle pages. Results are
+ * checked against each other.
+ *
+ * usage: sgbench [periods] [gain]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "sgcopy.h"
+
+#define N_PAGES 8
+#define PAGE_SIZE 4096
+#define PERIOD_FRAMES 1024
+#define PERIOD_BYTES (PERIOD_FRAMES * 4)
+#define START_PTR 1000
+
+#define RING_SIZE (N_PAGES * PAGE_SIZE)
+
+static char *ring;
+static void *pages[N_PAGES];
+static int16_t period[PERIOD_BYTES / 2];
+static int16_t check[PERIOD_BYTES / 2];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What get_data_from_sg() and put_data_to_sg() used to do */
+static void old_read(int16_t *dst, int size, int *ptr, int val)
+{
+    int16_t *src;
+
+    size = size / 2;
+    while (size--) {
+        src = (int16_t *)((char *)pages[*ptr / PAGE_SIZE] + *ptr % PAGE_SIZE);
+        *dst++ = (*src) * val / 100;
+
+        *ptr += 2;
+        if (*ptr == RING_SIZE)
+            *ptr = 0;
+    }
+}
+
+static void old_write(const int16_t *src, int size, int *ptr, int val)
+{
+    int16_t *dst;
+
+    size = size / 2;
+    while (size--) {
+        dst = (int16_t *)((char *)pages[*ptr / PAGE_SIZE] + *ptr % PAGE_SIZE);
+        *dst = (*src++) * val / 100;
+
+        *ptr += 2;
+        if (*ptr == RING_SIZE)
+            *ptr = 0;
+    }
+}
+
+static void fill(void)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < RING_SIZE / 2; i++)
+        ((int16_t *)ring)[i] = rand();
+}
+
+static double run(unsigned long periods, int gain, int new)
+{
+    uint64_t start;
+    unsigned long i;
+    int ptr = START_PTR;
+
+    start = now_ns();
+    for (i = 0; i < periods; i++) {
+        if (new) {
+            sg_read(period, ring, RING_SIZE, &ptr, PERIOD_BYTES, gain);
+            sg_write(ring, RING_SIZE, &ptr, period, PERIOD_BYTES, PCM_GAIN_UNITY);
+        } else {
+            old_read(period, PERIOD_BYTES, &ptr, gain);
+            old_write(period, PERIOD_BYTES, &ptr, PCM_GAIN_UNITY);
+        }
+    }
+
+    /* Per period, one read and one write */
+    return (double)(now_ns() - start) / periods;
+}
+
+/* Compare one period through both paths, from the same ring contents */
+static int verify(int gain)
+{
+    int ptr, i, diff;
+
+    fill();
+    ptr = START_PTR;
+    old_read(check, PERIOD_BYTES, &ptr, gain);
+    ptr = START_PTR;
+    sg_read(period, ring, RING_SIZE, &ptr, PERIOD_BYTES, gain);
+    if (ptr != START_PTR + PERIOD_BYTES)
+        return -1;
+
+    /* The Q15 gain may round differently from "* gain / 100" by one */
+    for (i = 0; i < PERIOD_BYTES / 2; i++) {
+        diff = period[i] - check[i];
+        if (diff < -1 || diff > 1 || (gain >= PCM_GAIN_UNITY && diff))
+            return -1;
+    }
+
+    ptr = RING_SIZE - 6;
+    sg_write(ring, RING_SIZE, &ptr, check, PERIOD_BYTES, PCM_GAIN_UNITY);
+    ptr = RING_SIZE - 6;
+    sg_read(period, ring, RING_SIZE, &ptr, PERIOD_BYTES, PCM_GAIN_UNITY);
+    if (ptr != PERIOD_BYTES - 6 || memcmp(period, check, PERIOD_BYTES))
+        return -1;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long periods = 200000;
+    int gain = 70;
+    double old_ns, new_ns;
+    int i, g;
+
+    if (argc > 1)
+        periods = strtoul(argv[1], NULL, 0);
+    if (argc > 2)
+        gain = atoi(argv[2]);
+    if (!periods || gain < 0 || gain >= PCM_GAIN_UNITY) {
+        fprintf(stderr, "usage: %s [periods] [gain, 0 to 99]\n", argv[0]);
+        return 1;
+    }
+
+    ring = malloc(RING_SIZE);
+    if (!ring)
+        return 1;
+    for (i = 0; i < N_PAGES; i++)
+        pages[i] = ring + i * PAGE_SIZE;
+
+    if (verify(PCM_GAIN_UNITY) || verify(gain)) {
+        fprintf(stderr, "sg_read/sg_write disagree with the reference\n");
+        return 1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        g = i ? gain : PCM_GAIN_UNITY;
+        fill();
+        old_ns = run(periods, g, 0);
+        new_ns = run(periods, g, 1);
+        printf("gain %3d: per-sample %8.0f ns/period, chunked %6.0f ns/period, "
+               "%.1fx\n", g, old_ns, new_ns, old_ns / new_ns);
+    }
+
+    return 0;
+}
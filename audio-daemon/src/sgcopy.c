@@ -0,0 +1,127 @@
+/*
+ * sgcopy.c:
+ *
+ * Sample copies between ALSA periods and the guest DMA buffers.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "sgcopy.h"
+
+/*
+ * dst[i] = src[i] * gain / 100, with the gain as a Q15 multiplier so it is
+ * one multiply and a shift per sample. The SIMD loops get the 32 bit
+ * products from mullo/mulhi, shift them and pack them back, which gives
+ * the same result as the scalar tail.
+ */
+void pcm_copy_gain(int16_t *dst, const int16_t *src, size_t n, int gain)
+{
+    int32_t g;
+    size_t i = 0;
+
+    if (gain >= PCM_GAIN_UNITY) {
+        memcpy(dst, src, n * sizeof (*dst));
+        return;
+    }
+    if (gain < 0)
+        gain = 0;
+    g = gain * 32768 / PCM_GAIN_UNITY;
+
+#if defined(__AVX2__)
+    {
+        __m256i vg = _mm256_set1_epi16(g);
+
+        for (; i + 16 <= n; i += 16) {
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i lo = _mm256_mullo_epi16(s, vg);
+            __m256i hi = _mm256_mulhi_epi16(s, vg);
+            __m256i p0 = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 15);
+            __m256i p1 = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 15);
+
+            _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packs_epi32(p0, p1));
+        }
+    }
+#elif defined(__SSE2__)
+    {
+        __m128i vg = _mm_set1_epi16(g);
+
+        for (; i + 8 <= n; i += 8) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i lo = _mm_mullo_epi16(s, vg);
+            __m128i hi = _mm_mulhi_epi16(s, vg);
+            __m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 15);
+            __m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 15);
+
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(p0, p1));
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = (src[i] * g) >> 15;
+}
+
+void sg_read(int16_t *dst, const void *ring, int size, int *ptr, int bytes,
+             int gain)
+{
+    int n;
+
+    while (bytes > 0) {
+        n = size - *ptr;
+        if (n > bytes)
+            n = bytes;
+
+        pcm_copy_gain(dst, (const int16_t *)((const char *)ring + *ptr), n / 2,
+                      gain);
+
+        dst += n / 2;
+        bytes -= n;
+        *ptr += n;
+        if (*ptr == size)
+            *ptr = 0;
+    }
+}
+
+void sg_write(void *ring, int size, int *ptr, const int16_t *src, int bytes,
+              int gain)
+{
+    int n;
+
+    while (bytes > 0) {
+        n = size - *ptr;
+        if (n > bytes)
+            n = bytes;
+
+        pcm_copy_gain((int16_t *)((char *)ring + *ptr), src, n / 2, gain);
+
+        src += n / 2;
+        bytes -= n;
+        *ptr += n;
+        if (*ptr == size)
+            *ptr = 0;
+    }
+}
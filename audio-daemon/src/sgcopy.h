@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _SGCOPY_H_
+#define _SGCOPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Gains are in percent, anything from 100 up is a plain copy */
+#define PCM_GAIN_UNITY 100
+
+void pcm_copy_gain(int16_t *dst, const int16_t *src, size_t n, int gain);
+
+/*
+ * Copy between a linear buffer and a ring of size bytes, starting at byte
+ * offset *ptr in the ring, which is advanced and wraps around. The copy is
+ * only split where it wraps.
+ */
+void sg_read(int16_t *dst, const void *ring, int size, int *ptr, int bytes,
+             int gain);
+void sg_write(void *ring, int size, int *ptr, const int16_t *src, int bytes,
+              int gain);
+
+#endif
@@ -1,36 +1,362 @@
 /*
  * Copyright (c) 2011 Citrix Systems, Inc.
- * 
+ *
  * This library is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Lesser General Public
  * License as published by the Free Software Foundation; either
  * version 2.1 of the License, or (at your option) any later version.
- * 
+ *
  * This library is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
  * Lesser General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+/*
+ * Benchmark device model, to be run against server.
+ *
+ * Throughput: send count messages of the given type, burst messages per
+ * write, then wait for the reply to a display_get_info so that every
+ * message has been dispatched before the clock stops. The replies to
+ * messages that have one (resize) are read between bursts, and no more
+ * than MAX_UNREAD of them are left waiting, well under what the service
+ * queues for a client.
+ *
+ * Latency (-m info): issue count display_get_info calls one at a time,
+ * and report the round trip distribution.
+ *
+ * Pipelining (-m pipeline): issue count display_get_info calls, keeping
+ * up to burst of them outstanding, and report the call rate.
+ *
+ * usage: client [-u] [-s] [-m leds|abs|resize|info|pipeline] [-n count]
+ *               [-b burst]
+ *   -u  use the UNIX domain transport instead of v4v
+ *   -s  offer shared memory rings to the service (needs -u)
+ */
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <time.h>
 
 #include <stdint.h>
 #include <libv4v.h>
 #include <libdmbus.h>
 
-int main(void)
+#define MAX_UNREAD 1024
+
+static dmbus_conn_t conn;
+
+/* Variable length messages can be larger than union dmbus_msg */
+static uint64_t rx_buf[DMBUS_MAX_MSG_LEN / sizeof (uint64_t)];
+
+static uint64_t now_ns(void)
 {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait for a message of the given type, skipping anything else */
+static int wait_msg(uint32_t type)
+{
+    union dmbus_msg *m = (union dmbus_msg *)rx_buf;
+    ssize_t rc;
+
+    for (;;) {
+        rc = dmbus_conn_recv(conn, rx_buf, sizeof (rx_buf), 0);
+        if (rc == 0)
+            errno = EPIPE;
+        if (rc <= 0)
+            return -1;
+        if (DMBUS_MSG_TYPE(m->hdr.msg_type) == type)
+            return 0;
+    }
+}
+
+/*
+ * Read the replies that have come in, and wait for more while over
+ * max_unread of the sent ones have not.
+ */
+static int drain(unsigned long sent, unsigned long *read,
+                 unsigned long max_unread)
+{
+    union dmbus_msg *m = (union dmbus_msg *)rx_buf;
+    ssize_t rc;
+
+    for (;;) {
+        rc = dmbus_conn_recv(conn, rx_buf, sizeof (rx_buf),
+                             sent - *read > max_unread ? 0 : MSG_DONTWAIT);
+        if (rc == 0)
+            errno = EPIPE;
+        if (rc <= 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        if (DMBUS_MSG_TYPE(m->hdr.msg_type) == DMBUS_MSG_EMPTY_REPLY)
+            (*read)++;
+    }
+}
+
+static int get_info(void)
+{
+    struct msg_display_get_info req;
+
+    req.hdr.msg_len = sizeof (req);
+    req.hdr.msg_type = DMBUS_MSG_DISPLAY_GET_INFO;
+    req.hdr.return_value = 0;
+    req.DisplayID = 0;
+
+    if (dmbus_conn_send(conn, &req, sizeof (req)))
+        return -1;
+
+    return wait_msg(DMBUS_MSG_DISPLAY_INFO);
+}
+
+/* Same as get_info(), through the call interface */
+static int call_info(void)
+{
+    struct msg_display_get_info req;
+    struct dmbus_future f;
+
+    req.hdr.return_value = 0;
+    req.DisplayID = 0;
+    memset(&f, 0, sizeof (f));
+
+    if (display_get_info_call(conn, &req, sizeof (req), dmbus_future_complete,
+                              &f) ||
+        dmbus_conn_wait(conn, &f.done))
+        return -1;
+    if (f.err) {
+        errno = f.err;
+        return -1;
+    }
+
     return 0;
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int latency(unsigned long count)
+{
+    uint64_t *rtt, sum = 0;
+    unsigned long i;
+
+    rtt = calloc(count, sizeof (*rtt));
+    if (!rtt)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        uint64_t start = now_ns();
+
+        if (call_info())
+            return -1;
+        rtt[i] = now_ns() - start;
+        sum += rtt[i];
+    }
+
+    qsort(rtt, count, sizeof (*rtt), cmp_u64);
+    printf("display_get_info round trip over %lu calls (us): min %.1f "
+           "avg %.1f p50 %.1f p99 %.1f max %.1f\n", count,
+           rtt[0] / 1e3, sum / (double)count / 1e3, rtt[count / 2] / 1e3,
+           rtt[count * 99 / 100] / 1e3, rtt[count - 1] / 1e3);
+
+    free(rtt);
+
+    return 0;
+}
+
+static unsigned long replies;
+static int replied;
+
+static void info_reply(dmbus_conn_t conn, void *opaque, void *reply,
+                       size_t len, int err)
+{
+    (void)conn;
+    (void)opaque;
+    (void)reply;
+    (void)len;
+
+    if (!err)
+        replies++;
+    replied = 1;
+}
+
+static int pipeline(unsigned long count, unsigned int depth)
+{
+    struct msg_display_get_info req;
+    uint64_t start, elapsed;
+    unsigned long i;
+
+    if (depth > DMBUS_CONN_MAX_CALLS)
+        depth = DMBUS_CONN_MAX_CALLS;
+
+    start = now_ns();
+    for (i = 0; i < count; i++) {
+        /* Make room, at least one reply has to come in */
+        if (i - replies >= depth) {
+            replied = 0;
+            if (dmbus_conn_wait(conn, &replied))
+                return -1;
+        }
+
+        req.hdr.return_value = 0;
+        req.DisplayID = 0;
+        if (display_get_info_call(conn, &req, sizeof (req), info_reply, NULL))
+            return -1;
+    }
+    if (dmbus_conn_wait(conn, NULL))
+        return -1;
+    elapsed = now_ns() - start;
+
+    if (replies != count) {
+        fprintf(stderr, "%lu replies to %lu calls\n", replies, count);
+        errno = EPROTO;
+        return -1;
+    }
+
+    printf("%lu display_get_info calls, %u deep, in %.3fs: %.0f calls/s, "
+           "%.2fus per call\n", count, depth, elapsed / 1e9,
+           count / (elapsed / 1e9), elapsed / (double)count / 1e3);
+
+    return 0;
+}
+
+static int throughput(const char *mode, unsigned long count, unsigned int burst)
+{
+    union dmbus_msg *msgs;
+    size_t len;
+    uint32_t type;
+    uint64_t start, elapsed;
+    unsigned long left = count, read = 0;
+    unsigned int i;
+    int replies = 0;
+
+    if (!strcmp(mode, "leds")) {
+        type = DMBUS_MSG_SWITCHER_LEDS;
+        len = sizeof (struct msg_switcher_leds);
+    } else if (!strcmp(mode, "abs")) {
+        type = DMBUS_MSG_SWITCHER_ABS;
+        len = sizeof (struct msg_switcher_abs);
+    } else if (!strcmp(mode, "resize")) {
+        type = DMBUS_MSG_DISPLAY_RESIZE;
+        len = sizeof (struct msg_display_resize);
+        replies = 1;
+    } else {
+        fprintf(stderr, "unknown message type %s\n", mode);
+        return -1;
+    }
+
+    /* Messages are packed back to back in the burst buffer */
+    msgs = calloc(burst, len);
+    if (!msgs)
+        return -1;
+    for (i = 0; i < burst; i++) {
+        struct dmbus_msg_hdr *hdr = (void *)((char *)msgs + i * len);
+
+        hdr->msg_len = len;
+        hdr->msg_type = type;
+    }
+
+    start = now_ns();
+    while (left) {
+        unsigned int n = left < burst ? left : burst;
+
+        if (dmbus_conn_send(conn, msgs, n * len))
+            return -1;
+        left -= n;
+        /* Or they pile up in the service, queued for us */
+        if (replies && drain(count - left, &read, MAX_UNREAD))
+            return -1;
+    }
+    if (get_info())
+        return -1;
+    elapsed = now_ns() - start;
+
+    printf("%lu %s messages of %zu bytes in %.3fs: %.0f msg/s, %.1f MB/s\n",
+           count, mode, len, elapsed / 1e9, count / (elapsed / 1e9),
+           count * len / (elapsed / 1e3));
+
+    free(msgs);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = "leds";
+    unsigned long count = 1000000;
+    unsigned int burst = 64;
+    const struct dmbus_transport *t = &dmbus_transport_v4v;
+    int flags = 0;
+    int opt, rc;
+
+    while ((opt = getopt(argc, argv, "usm:n:b:")) != -1) {
+        switch (opt) {
+        case 'u':
+            t = &dmbus_transport_unix;
+            break;
+        case 's':
+            flags |= DMBUS_CONN_SHM;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            burst = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!count || !burst)
+        goto usage;
+
+    conn = dmbus_conn_open(t, DMBUS_SERVICE_DUMMY, 0, DEVICE_TYPE_EMULATION,
+                           flags);
+    if (!conn) {
+        perror("dmbus_conn_open");
+        return 1;
+    }
+    if ((flags & DMBUS_CONN_SHM) && !dmbus_conn_is_shm(conn))
+        fprintf(stderr, "shared memory refused, using the socket\n");
+
+    if (wait_msg(DMBUS_MSG_DEVICE_MODEL_READY)) {
+        perror("device_model_ready");
+        return 1;
+    }
+
+    if (!strcmp(mode, "info"))
+        rc = latency(count);
+    else if (!strcmp(mode, "pipeline"))
+        rc = pipeline(count, burst);
+    else
+        rc = throughput(mode, count, burst);
+    if (rc)
+        perror(mode);
+
+    dmbus_conn_close(conn);
+
+    return rc ? 1 : 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-u] [-s] [-m leds|abs|resize|info|pipeline] "
+            "[-n count] [-b burst]\n", argv[0]);
+    return 1;
+}
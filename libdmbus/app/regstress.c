@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * regstress: hammer the client registry of a dmbus service.
+ *
+ * One thread runs the event loop of a DUMMY service on the UNIX transport.
+ * Connector threads open device model connections, wait for an input_wakeup
+ * or a millisecond, and close them again, as fast as they can. Broadcaster
+ * threads meanwhile walk the connected clients and send each an
+ * input_wakeup. At the end every connection must have been seen coming and
+ * going, and the service must be left without clients. Run it under
+ * valgrind or a sanitizer to catch use after free.
+ *
+ * usage: regstress [-t seconds] [-c connectors] [-b broadcasters]
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <stdint.h>
+#include <libv4v.h>
+#include <libdmbus.h>
+
+#define MAX_THREADS 64
+
+static dmbus_service_t service;
+static int running = 1;
+static int looping = 1;
+
+static unsigned long connects;
+static unsigned long disconnects;
+static unsigned long cycles;
+static unsigned long received;
+static unsigned long walks;
+static unsigned long sent;
+static unsigned long failed;
+static unsigned long lost;
+
+#define COUNT(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#define GET(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+
+static struct dmbus_rpc_ops stress_rpc_ops;
+
+static int stress_connect(dmbus_client_t client, int domain, DeviceType type,
+                          int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                          void **priv)
+{
+    (void)client;
+    (void)domain;
+    (void)type;
+    (void)dm_domain;
+    (void)fd;
+
+    COUNT(connects, 1);
+
+    *ops = &stress_rpc_ops;
+    *priv = NULL;
+
+    return 0;
+}
+
+static void stress_disconnect(dmbus_client_t client, void *priv)
+{
+    (void)client;
+    (void)priv;
+
+    COUNT(disconnects, 1);
+}
+
+static void stress_send_error(dmbus_client_t client, void *priv,
+                              int msg_type, int err)
+{
+    (void)client;
+    (void)priv;
+    (void)msg_type;
+    (void)err;
+
+    COUNT(lost, 1);
+}
+
+static struct dmbus_service_ops stress_service_ops = {
+    .connect = stress_connect,
+    .disconnect = stress_disconnect,
+    .send_error = stress_send_error,
+};
+
+static void *loop_thread(void *arg)
+{
+    (void)arg;
+
+    while (GET(looping))
+        if (dmbus_service_dispatch(service, 100) == -1) {
+            perror("dmbus_service_dispatch");
+            exit(1);
+        }
+
+    return NULL;
+}
+
+static void *connector_thread(void *arg)
+{
+    uint64_t buf[DMBUS_MAX_MSG_LEN / sizeof (uint64_t)];
+    struct dmbus_msg_hdr *hdr = (void *)buf;
+    int domain = (intptr_t)arg;
+    dmbus_conn_t conn;
+    struct pollfd pfd;
+
+    while (GET(running)) {
+        conn = dmbus_conn_open(&dmbus_transport_unix, DMBUS_SERVICE_DUMMY,
+                               domain, DEVICE_TYPE_INPUT, 0);
+        if (!conn) {
+            perror("dmbus_conn_open");
+            exit(1);
+        }
+
+        pfd.fd = dmbus_conn_get_fd(conn);
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, 1) == 1 &&
+               dmbus_conn_recv(conn, buf, sizeof (buf), MSG_DONTWAIT) > 0)
+            if (hdr->msg_type == DMBUS_MSG_INPUT_WAKEUP) {
+                COUNT(received, 1);
+                break;
+            }
+
+        dmbus_conn_close(conn);
+        COUNT(cycles, 1);
+    }
+
+    return NULL;
+}
+
+static int wakeup(dmbus_client_t client, void *priv, void *opaque)
+{
+    struct msg_input_wakeup msg;
+
+    (void)priv;
+    (void)opaque;
+
+    if (input_wakeup(client, &msg, sizeof (msg)) == 0)
+        COUNT(sent, 1);
+    else
+        COUNT(failed, 1);
+
+    return 0;
+}
+
+static int count_client(dmbus_client_t client, void *priv, void *opaque)
+{
+    (void)client;
+    (void)priv;
+
+    (*(unsigned int *)opaque)++;
+
+    return 0;
+}
+
+static void *broadcaster_thread(void *arg)
+{
+    (void)arg;
+
+    while (GET(running)) {
+        dmbus_service_foreach_client(service, wakeup, NULL);
+        COUNT(walks, 1);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t loop, threads[MAX_THREADS];
+    unsigned int seconds = 5, nconnect = 4, nbroadcast = 4;
+    unsigned int i, n, left;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:c:b:")) != -1) {
+        switch (opt) {
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            nconnect = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            nbroadcast = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (!nconnect || nconnect + nbroadcast > MAX_THREADS)
+        goto usage;
+
+    service = dmbus_service_create(DMBUS_SERVICE_DUMMY, &stress_service_ops,
+                                   &dmbus_transport_unix);
+    if (!service || dmbus_service_get_epoll_fd(service) == -1) {
+        perror("dmbus_service_create");
+        return 1;
+    }
+
+    pthread_create(&loop, NULL, loop_thread, NULL);
+    for (i = 0; i < nconnect; i++)
+        pthread_create(&threads[i], NULL, connector_thread,
+                       (void *)(intptr_t)(i + 1));
+    for (; i < nconnect + nbroadcast; i++)
+        pthread_create(&threads[i], NULL, broadcaster_thread, NULL);
+
+    sleep(seconds);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    for (i = 0; i < nconnect + nbroadcast; i++)
+        pthread_join(threads[i], NULL);
+
+    /* Let the loop catch up with the last connections */
+    for (left = 50; left && GET(disconnects) != cycles; left--)
+        usleep(100000);
+    __atomic_store_n(&looping, 0, __ATOMIC_RELEASE);
+    pthread_join(loop, NULL);
+
+    n = 0;
+    dmbus_service_foreach_client(service, count_client, &n);
+
+    printf("%lu connections in %us (%.0f/s)\n", cycles, seconds,
+           cycles / (double)seconds);
+    printf("%lu walks (%.0f/s), %lu wakeups sent, %lu received, "
+           "%lu failed, %lu reported lost\n", walks, walks / (double)seconds,
+           sent, received, failed, lost);
+
+    if (connects != cycles || disconnects != cycles || n) {
+        fprintf(stderr, "registry out of step: %lu connected, "
+                "%lu disconnected, %u left\n", connects, disconnects, n);
+        return 1;
+    }
+
+    dmbus_service_destroy(service);
+
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-t seconds] [-c connectors] "
+            "[-b broadcasters]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * replay: play a dmbus capture back against a service.
+ *
+ * Every client of the capture gets a device model connection, with its
+ * domain and device type, on which what it sent is sent again, at the
+ * original pace, or as fast as possible with -f, in which case messages
+ * of a client that follow each other go in one write. What the service
+ * sends back is read and counted, to be compared with the capture; a
+ * client is only closed once it got as many messages as it did when
+ * captured, or the service has been quiet for a while. Run the
+ * service on the UNIX domain transport to replay production traffic on
+ * any machine, e.g. with DMBUS_CAPTURE set on the production side.
+ *
+ * usage: replay [-u] [-s] [-f] capture
+ *   -u  use the UNIX domain transport instead of v4v
+ *   -s  offer shared memory rings to the service (needs -u)
+ *   -f  as fast as possible, rather than at the original pace
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include <stdint.h>
+#include <libv4v.h>
+#include <libdmbus.h>
+
+/* Look for replies every so many messages sent to a client */
+#define DRAIN_INTERVAL 32
+
+/* How long the service may stay quiet before giving up on a reply */
+#define SETTLE_MS 200
+
+/* Most messages sent in one write with -f */
+#define BATCH_SIZE (64 * DMBUS_MAX_MSG_LEN)
+
+struct replay_client
+{
+    dmbus_conn_t conn;
+    unsigned int unread;
+    unsigned long expected; /* Sent by the service in the capture */
+    unsigned long received;
+};
+
+static struct replay_client *clients;
+static uint32_t nclients;
+
+/* Messages of one client waiting to be sent together */
+static uint8_t batch[BATCH_SIZE];
+static size_t batch_len;
+static unsigned int batch_count;
+static struct replay_client *batch_client;
+
+static unsigned long sent, sent_bytes, received, captured_tx, skipped;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct replay_client *client_get(uint32_t id)
+{
+    struct replay_client *n;
+
+    if (id >= nclients) {
+        n = realloc(clients, (id + 1) * sizeof (*n));
+        if (!n)
+            return NULL;
+        memset(n + nclients, 0, (id + 1 - nclients) * sizeof (*n));
+        clients = n;
+        nclients = id + 1;
+    }
+
+    return &clients[id];
+}
+
+static void drain(struct replay_client *rc)
+{
+    static uint64_t buf[DMBUS_MAX_LARGE_MSG_LEN / sizeof (uint64_t)];
+
+    while (dmbus_conn_recv(rc->conn, buf, sizeof (buf), MSG_DONTWAIT) > 0) {
+        rc->received++;
+        received++;
+    }
+    rc->unread = 0;
+}
+
+/* Wait for what the service sent this client in the capture */
+static void drain_expected(struct replay_client *rc)
+{
+    struct pollfd pfd;
+
+    drain(rc);
+    pfd.fd = dmbus_conn_get_fd(rc->conn);
+    pfd.events = POLLIN;
+    while (rc->received < rc->expected && poll(&pfd, 1, SETTLE_MS) == 1)
+        drain(rc);
+}
+
+static int batch_flush(void)
+{
+    struct replay_client *rc = batch_client;
+
+    if (!batch_len)
+        return 0;
+
+    if (dmbus_conn_send(rc->conn, batch, batch_len)) {
+        perror("dmbus_conn_send");
+        return -1;
+    }
+    sent += batch_count;
+    sent_bytes += batch_len;
+    rc->unread += batch_count;
+    if (rc->unread >= DRAIN_INTERVAL)
+        drain(rc);
+
+    batch_len = 0;
+    batch_count = 0;
+
+    return 0;
+}
+
+static int send_message(struct replay_client *rc, const void *msg,
+                        size_t len, int fast)
+{
+    if (rc != batch_client || BATCH_SIZE - batch_len < len)
+        if (batch_flush())
+            return -1;
+
+    batch_client = rc;
+    memcpy(batch + batch_len, msg, len);
+    batch_len += len;
+    batch_count++;
+
+    return fast ? 0 : batch_flush();
+}
+
+static void drain_all(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < nclients; i++)
+        if (clients[i].conn)
+            drain(&clients[i]);
+}
+
+/* Read what is left until the service has been quiet for SETTLE_MS */
+static void settle(void)
+{
+    unsigned long before;
+
+    do {
+        before = received;
+        poll(NULL, 0, SETTLE_MS);
+        drain_all();
+    } while (received != before);
+}
+
+static void wait_until(uint64_t deadline)
+{
+    struct timespec ts;
+
+    drain_all();
+
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        continue;
+}
+
+static int replay(const uint8_t *p, const uint8_t *end,
+                  const struct dmbus_capture_header *hdr,
+                  const struct dmbus_transport *t, int flags, int fast)
+{
+    const struct dmbus_capture_connect *cc;
+    const struct dmbus_msg_hdr *mh;
+    struct dmbus_capture_record rec;
+    struct replay_client *rc;
+    uint64_t start = 0, done, first = 0, last = 0;
+
+    while (p < end) {
+        if ((size_t)(end - p) < sizeof (rec)) {
+            fprintf(stderr, "truncated record\n");
+            return -1;
+        }
+        memcpy(&rec, p, sizeof (rec));
+        p += sizeof (rec);
+        if ((size_t)(end - p) < rec.len) {
+            fprintf(stderr, "truncated record\n");
+            return -1;
+        }
+
+        if (!start) {
+            start = now_ns();
+            first = rec.ns;
+        }
+        last = rec.ns;
+        if (!fast && rec.ns - first > now_ns() - start)
+            wait_until(start + (rec.ns - first));
+
+        rc = client_get(rec.client);
+        if (!rc)
+            return -1;
+
+        if (rec.kind != DMBUS_CAPTURE_RX && batch_flush())
+            return -1;
+
+        switch (rec.kind) {
+        case DMBUS_CAPTURE_CONNECT:
+            cc = (const void *)p;
+            if (rec.len < sizeof (*cc) || rc->conn)
+                break;
+            rc->conn = dmbus_conn_open(t, hdr->service_id, cc->domain,
+                                       cc->type, flags);
+            if (!rc->conn) {
+                perror("dmbus_conn_open");
+                return -1;
+            }
+            break;
+        case DMBUS_CAPTURE_DISCONNECT:
+            if (!rc->conn)
+                break;
+            drain_expected(rc);
+            dmbus_conn_close(rc->conn);
+            rc->conn = NULL;
+            break;
+        case DMBUS_CAPTURE_RX:
+            if (!rc->conn) {
+                skipped++;
+                break;
+            }
+            if (send_message(rc, p, rec.len, fast))
+                return -1;
+            break;
+        case DMBUS_CAPTURE_TX:
+            /* The library keeps service_caps to itself */
+            mh = (const void *)p;
+            if (rec.len >= sizeof (*mh) &&
+                DMBUS_MSG_TYPE(mh->msg_type) == DMBUS_MSG_SERVICE_CAPS)
+                break;
+            rc->expected++;
+            captured_tx++;
+            break;
+        }
+
+        p += rec.len;
+    }
+
+    if (batch_flush())
+        return -1;
+    /* Before the replies are waited for, which takes SETTLE_MS at least */
+    done = now_ns();
+    settle();
+
+    printf("%lu messages, %lu bytes, sent in %.3fs, captured over %.3fs: "
+           "%.0f msg/s\n", sent, sent_bytes, (done - start) / 1e9,
+           (last - first) / 1e9, sent / ((done - start) / 1e9));
+    printf("%lu messages from the service, %lu in the capture, "
+           "%lu sent by unknown clients skipped\n",
+           received, captured_tx, skipped);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const struct dmbus_transport *t = &dmbus_transport_v4v;
+    const struct dmbus_capture_header *hdr;
+    int flags = 0, fast = 0;
+    struct stat st;
+    uint8_t *map;
+    uint32_t i;
+    int opt, fd, rc;
+
+    while ((opt = getopt(argc, argv, "usf")) != -1) {
+        switch (opt) {
+        case 'u':
+            t = &dmbus_transport_unix;
+            break;
+        case 's':
+            flags |= DMBUS_CONN_SHM;
+            break;
+        case 'f':
+            fast = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1)
+        goto usage;
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (st.st_size < (off_t)sizeof (*hdr)) {
+        fprintf(stderr, "%s: not a dmbus capture\n", argv[optind]);
+        return 1;
+    }
+
+    /* Read up front, so the replay does not wait on the disk */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    hdr = (const void *)map;
+    if (memcmp(hdr->magic, DMBUS_CAPTURE_MAGIC, sizeof (hdr->magic)) ||
+        hdr->version != DMBUS_CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a dmbus capture\n", argv[optind]);
+        return 1;
+    }
+    if (memcmp(hdr->hash, DMBUS_SHA1_STRING, sizeof (hdr->hash)))
+        fprintf(stderr, "warning: captured with another version of the "
+                "dmbus interface\n");
+
+    rc = replay(map + sizeof (*hdr), map + st.st_size, hdr, t, flags, fast);
+
+    for (i = 0; i < nclients; i++)
+        if (clients[i].conn)
+            dmbus_conn_close(clients[i].conn);
+    munmap(map, st.st_size);
+
+    return rc ? 1 : 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-u] [-s] [-f] capture\n", argv[0]);
+    return 1;
+}
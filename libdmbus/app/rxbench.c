@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * rxbench: measure the receive/dispatch rate of a dmbus service.
+ *
+ * A child process connects to the DUMMY service and floods it with
+ * switcher_leds messages, written in bursts to mimic an input storm.
+ * The parent runs the service and reports the number of messages
+ * dispatched per second. Run it against two builds of libdmbus to
+ * compare them. With -l the service uses the built-in dmbus_run() loop
+ * rather than select().
+ *
+ * usage: rxbench [-l] [-u] [messages] [messages-per-burst]
+ *   -u  use the UNIX domain transport instead of v4v
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+
+#include <stdint.h>
+#include <libv4v.h>
+#include <libdmbus.h>
+
+static unsigned long received;
+static int client_fd = -1;
+static dmbus_client_t client;
+
+static void count_leds(void *priv, struct msg_switcher_leds *msg, size_t msglen)
+{
+    (void)priv;
+    (void)msg;
+    (void)msglen;
+
+    received++;
+}
+
+static struct dmbus_rpc_ops bench_rpc_ops = {
+    .switcher_leds = count_leds,
+};
+
+static int bench_connect(dmbus_client_t c, int domain, DeviceType type,
+                         int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                         void **priv)
+{
+    (void)domain;
+    (void)type;
+    (void)dm_domain;
+
+    client = c;
+    client_fd = fd;
+    *ops = &bench_rpc_ops;
+    *priv = NULL;
+
+    return 0;
+}
+
+static void bench_disconnect(dmbus_client_t c, void *priv)
+{
+    (void)c;
+    (void)priv;
+
+    client = NULL;
+    client_fd = -1;
+    dmbus_stop();
+}
+
+static struct dmbus_service_ops bench_service_ops = {
+    .connect = bench_connect,
+    .disconnect = bench_disconnect,
+};
+
+static int send_all(const struct dmbus_transport *t, int fd,
+                    const void *buf, size_t len)
+{
+    size_t b = 0;
+    ssize_t rc;
+
+    while (b < len) {
+        rc = t->send(fd, (const char *)buf + b, len - b, 0);
+        if (rc < 0)
+            return -1;
+        b += rc;
+    }
+
+    return 0;
+}
+
+static int flood(const struct dmbus_transport *t, unsigned long count,
+                 unsigned int burst)
+{
+    struct msg_switcher_leds *msgs;
+    unsigned int i;
+    int fd;
+
+    fd = dmbus_connect(t, DMBUS_SERVICE_DUMMY, 0, DEVICE_TYPE_INPUT);
+    if (fd < 0)
+        return 1;
+
+    msgs = calloc(burst, sizeof (*msgs));
+    if (!msgs)
+        return 1;
+    for (i = 0; i < burst; i++) {
+        msgs[i].hdr.msg_len = sizeof (*msgs);
+        msgs[i].hdr.msg_type = DMBUS_MSG_SWITCHER_LEDS;
+        msgs[i].led_code = i;
+    }
+
+    while (count) {
+        unsigned int n = count < burst ? count : burst;
+
+        if (send_all(t, fd, msgs, n * sizeof (*msgs)))
+            return 1;
+        count -= n;
+    }
+
+    free(msgs);
+    t->close(fd);
+
+    return 0;
+}
+
+static void select_loop(int listen_fd)
+{
+    for (;;) {
+        fd_set fds;
+        int nfds = listen_fd;
+
+        FD_ZERO(&fds);
+        FD_SET(listen_fd, &fds);
+        if (client_fd != -1) {
+            FD_SET(client_fd, &fds);
+            if (client_fd > nfds)
+                nfds = client_fd;
+        }
+
+        if (select(nfds + 1, &fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            return;
+        }
+
+        if (FD_ISSET(listen_fd, &fds))
+            dmbus_handle_connect(listen_fd);
+        if (client_fd != -1 && FD_ISSET(client_fd, &fds)) {
+            dmbus_handle_events(client);
+            if (!client)
+                return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const struct dmbus_transport *t = &dmbus_transport_v4v;
+    unsigned long count = 1000000;
+    unsigned int burst = 64;
+    struct timeval start, end;
+    double elapsed;
+    int use_loop = 0;
+    int listen_fd;
+    int opt;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "lu")) != -1) {
+        switch (opt) {
+        case 'l':
+            use_loop = 1;
+            break;
+        case 'u':
+            t = &dmbus_transport_unix;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind < argc)
+        count = strtoul(argv[optind], NULL, 0);
+    if (optind + 1 < argc)
+        burst = strtoul(argv[optind + 1], NULL, 0);
+    if (!count || !burst)
+        goto usage;
+
+    listen_fd = dmbus_init_transport(DMBUS_SERVICE_DUMMY, &bench_service_ops,
+                                     t);
+    if (listen_fd < 0) {
+        perror("dmbus_init_transport");
+        return 1;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+        _exit(flood(t, count, burst));
+
+    gettimeofday(&start, NULL);
+
+    if (use_loop) {
+        if (dmbus_run())
+            perror("dmbus_run");
+    } else
+        select_loop(listen_fd);
+
+    gettimeofday(&end, NULL);
+    waitpid(pid, NULL, 0);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%lu/%lu messages in %.3fs: %.0f msg/s\n",
+           received, count, elapsed, received / elapsed);
+
+    dmbus_cleanup();
+
+    return received == count ? 0 : 1;
+
+usage:
+    fprintf(stderr, "usage: %s [-l] [-u] [messages] [messages-per-burst]\n",
+            argv[0]);
+    return 1;
+}
@@ -1,21 +1,35 @@
 /*
  * Copyright (c) 2011 Citrix Systems, Inc.
- * 
+ *
  * This library is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Lesser General Public
  * License as published by the Free Software Foundation; either
  * version 2.1 of the License, or (at your option) any later version.
- * 
+ *
  * This library is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
  * Lesser General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+/*
+ * Benchmark service, to be driven by client.
+ *
+ * Implements every inbound RPC with a handler that only counts, so what
+ * is measured is the dmbus dispatch path. A summary per message type is
+ * printed whenever a client disconnects, SIGUSR1 dumps the statistics
+ * kept by the library.
+ *
+ * usage: server [-u] [-1] [-x]
+ *   -u  use the UNIX domain transport instead of v4v
+ *   -1  exit after the first client disconnects
+ *   -x  turn the library statistics off, to measure what they cost
+ */
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -23,12 +37,204 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
 
 #include <stdint.h>
 #include <libv4v.h>
 #include <libdmbus.h>
 
-int main(void)
+#define MAX_MSG_TYPE 32
+
+struct type_stats {
+    unsigned long count;
+    unsigned long bytes;
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+static struct type_stats stats[MAX_MSG_TYPE];
+static int once;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void account(struct dmbus_msg_hdr *hdr, size_t len)
+{
+    struct type_stats *st;
+    uint64_t now = now_ns();
+    unsigned int type = DMBUS_MSG_TYPE(hdr->msg_type);
+
+    if (type >= MAX_MSG_TYPE)
+        return;
+
+    st = &stats[type];
+    if (!st->count)
+        st->first_ns = now;
+    st->last_ns = now;
+    st->count++;
+    st->bytes += len;
+}
+
+static int bench_display_resize(void *priv, struct msg_display_resize *msg,
+                                size_t msglen, struct msg_empty_reply *out)
 {
+    (void)priv;
+    (void)out;
+
+    account(&msg->hdr, msglen);
+    return 0;
+}
+
+static int bench_display_get_info(void *priv, struct msg_display_get_info *msg,
+                                  size_t msglen, struct msg_display_info *out)
+{
+    (void)priv;
+
+    account(&msg->hdr, msglen);
+
+    out->DisplayID = msg->DisplayID;
+    out->max_xres = 1920;
+    out->max_yres = 1200;
+    out->align = 64;
+
+    return 0;
+}
+
+#define COUNTING_HANDLER(name)                                            \
+    static void bench_##name(void *priv, struct msg_##name *msg,          \
+                             size_t msglen)                               \
+    {                                                                     \
+        (void)priv;                                                       \
+        account(&msg->hdr, msglen);                                       \
+    }
+
+COUNTING_HANDLER(switcher_abs)
+COUNTING_HANDLER(switcher_pvm_domid)
+COUNTING_HANDLER(switcher_domid)
+COUNTING_HANDLER(switcher_leds)
+COUNTING_HANDLER(switcher_shutdown)
+
+static struct dmbus_rpc_ops bench_rpc_ops = {
+    .display_resize = bench_display_resize,
+    .display_get_info = bench_display_get_info,
+    .switcher_abs = bench_switcher_abs,
+    .switcher_pvm_domid = bench_switcher_pvm_domid,
+    .switcher_domid = bench_switcher_domid,
+    .switcher_leds = bench_switcher_leds,
+    .switcher_shutdown = bench_switcher_shutdown,
+};
+
+static void print_stats(void)
+{
+    int i;
+
+    printf("%-6s %12s %12s %12s %10s\n",
+           "type", "messages", "bytes", "msg/s", "ns/msg");
+    for (i = 0; i < MAX_MSG_TYPE; i++) {
+        struct type_stats *st = &stats[i];
+        double span;
+
+        if (!st->count)
+            continue;
+
+        span = (st->last_ns - st->first_ns) / 1e9;
+        printf("%-6d %12lu %12lu %12.0f %10.1f\n", i, st->count, st->bytes,
+               span > 0 ? st->count / span : 0.,
+               st->count > 1 ? (st->last_ns - st->first_ns) /
+                               (double)(st->count - 1) : 0.);
+    }
+    fflush(stdout);
+
+    memset(stats, 0, sizeof (stats));
+}
+
+static int bench_connect(dmbus_client_t client, int domain, DeviceType type,
+                         int dm_domain, int fd, struct dmbus_rpc_ops **ops,
+                         void **priv)
+{
+    (void)client;
+    (void)dm_domain;
+    (void)fd;
+
+    printf("client connected: domain %d, device type %u\n", domain, type);
+
+    *ops = &bench_rpc_ops;
+    *priv = NULL;
+
+    return 0;
+}
+
+static void bench_disconnect(dmbus_client_t client, void *priv)
+{
+    (void)client;
+    (void)priv;
+
+    print_stats();
+
+    if (once)
+        dmbus_stop();
+}
+
+static void bench_send_error(dmbus_client_t client, void *priv,
+                             int msg_type, int err)
+{
+    (void)client;
+    (void)priv;
+
+    fprintf(stderr, "lost message %d: %s\n", msg_type, strerror(err));
+}
+
+static struct dmbus_service_ops bench_service_ops = {
+    .connect = bench_connect,
+    .disconnect = bench_disconnect,
+    .send_error = bench_send_error,
+};
+
+int main(int argc, char **argv)
+{
+    const struct dmbus_transport *t = &dmbus_transport_v4v;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "u1x")) != -1) {
+        switch (opt) {
+        case 'u':
+            t = &dmbus_transport_unix;
+            break;
+        case '1':
+            once = 1;
+            break;
+        case 'x':
+            dmbus_stats_enable(0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-u] [-1] [-x]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (dmbus_init_transport(DMBUS_SERVICE_DUMMY, &bench_service_ops, t) < 0) {
+        perror("dmbus_init_transport");
+        return 1;
+    }
+
+    if (dmbus_stats_dump_on_signal(SIGUSR1))
+        perror("dmbus_stats_dump_on_signal");
+
+    printf("dummy service listening on %s\n", t->name);
+    fflush(stdout);
+
+    if (dmbus_run()) {
+        perror("dmbus_run");
+        return 1;
+    }
+
+    dmbus_cleanup();
+
     return 0;
 }
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Traffic capture, see capture.h.
+ */
+
+#include "project.h"
+#include "capture.h"
+
+struct dmbus_capture *dmbus_capture_create(void)
+{
+    struct dmbus_capture *cap;
+
+    cap = calloc(1, sizeof (*cap));
+    if (!cap)
+        return NULL;
+    pthread_mutex_init(&cap->lock, NULL);
+    cap->fd = -1;
+
+    return cap;
+}
+
+void dmbus_capture_destroy(struct dmbus_capture *cap)
+{
+    dmbus_capture_stop(cap);
+    pthread_mutex_destroy(&cap->lock);
+    free(cap);
+}
+
+/*
+ * Records are for replaying, which needs a clock of known base rather
+ * than the statistics one, that moves to the TSC once calibrated.
+ */
+static uint64_t capture_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    size_t b = 0;
+    ssize_t rc;
+
+    while (b < len) {
+        rc = write(fd, (const uint8_t *)buf + b, len - b);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        b += rc;
+    }
+
+    return 0;
+}
+
+/* Lock held */
+static void capture_close(struct dmbus_capture *cap)
+{
+    if (cap->owned)
+        close(cap->fd);
+    cap->fd = -1;
+    cap->len = 0;
+    store_release(&cap->active, 0);
+}
+
+/* Lock held, a capture that cannot be written stops */
+static void capture_write_out(struct dmbus_capture *cap)
+{
+    if (!cap->len)
+        return;
+
+    if (write_all(cap->fd, cap->buf, cap->len)) {
+        syslog(LOG_DAEMON | LOG_ERR, "%s: capture stopped: %s\n", __func__,
+               strerror(errno));
+        capture_close(cap);
+        return;
+    }
+    cap->len = 0;
+}
+
+int dmbus_capture_start(struct dmbus_capture *cap, int fd, int owned,
+                        int service_id)
+{
+    struct dmbus_capture_header hdr;
+
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, DMBUS_CAPTURE_MAGIC, sizeof (hdr.magic));
+    hdr.version = DMBUS_CAPTURE_VERSION;
+    hdr.service_id = service_id;
+    memcpy(hdr.hash, DMBUS_SHA1_STRING, sizeof (hdr.hash));
+
+    if (write_all(fd, &hdr, sizeof (hdr)))
+        return -1;
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->fd != -1) {
+        capture_write_out(cap);
+        if (cap->fd != -1)
+            capture_close(cap);
+    }
+    cap->fd = fd;
+    cap->owned = owned;
+    store_release(&cap->active, 1);
+    pthread_mutex_unlock(&cap->lock);
+
+    return 0;
+}
+
+void dmbus_capture_stop(struct dmbus_capture *cap)
+{
+    pthread_mutex_lock(&cap->lock);
+    if (cap->fd != -1) {
+        capture_write_out(cap);
+        if (cap->fd != -1)
+            capture_close(cap);
+    }
+    pthread_mutex_unlock(&cap->lock);
+}
+
+void dmbus_capture_frame(struct dmbus_capture *cap, uint32_t client,
+                         unsigned int kind, const void *data, size_t len)
+{
+    struct dmbus_capture_record rec;
+
+    pthread_mutex_lock(&cap->lock);
+    if (cap->fd == -1)
+        goto out;
+
+    /* Stamped under the lock, so the file is in time order */
+    rec.ns = capture_now();
+    rec.client = client;
+    rec.kind = kind;
+    rec.len = len;
+
+    if (DMBUS_CAPTURE_BUF_SIZE - cap->len < sizeof (rec) + len) {
+        capture_write_out(cap);
+        if (cap->fd == -1)
+            goto out;
+    }
+
+    memcpy(cap->buf + cap->len, &rec, sizeof (rec));
+    memcpy(cap->buf + cap->len + sizeof (rec), data, len);
+    cap->len += sizeof (rec) + len;
+
+out:
+    pthread_mutex_unlock(&cap->lock);
+}
+
+void dmbus_capture_flush(struct dmbus_capture *cap)
+{
+    pthread_mutex_lock(&cap->lock);
+    if (cap->fd != -1)
+        capture_write_out(cap);
+    pthread_mutex_unlock(&cap->lock);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __CAPTURE_H__
+# define __CAPTURE_H__
+
+/*
+ * Traffic capture, see dmbus_service_capture().
+ *
+ * Records are gathered in a buffer, written out when it is full and by
+ * dmbus_capture_flush(), which the event loop calls after each dispatch.
+ * Frames can be recorded from any thread. A capture is never freed while
+ * its service is alive, stopping it only closes the file.
+ */
+# define DMBUS_CAPTURE_BUF_SIZE (64 * 1024)
+
+struct dmbus_capture
+{
+    pthread_mutex_t lock;
+    int active;   /* Read without the lock, to skip it when not capturing */
+    int fd;
+    int owned;    /* Opened by the library, closed when stopping */
+    size_t len;
+    uint8_t buf[DMBUS_CAPTURE_BUF_SIZE];
+};
+
+struct dmbus_capture *dmbus_capture_create(void);
+void dmbus_capture_destroy(struct dmbus_capture *cap);
+int dmbus_capture_start(struct dmbus_capture *cap, int fd, int owned,
+                        int service_id);
+void dmbus_capture_stop(struct dmbus_capture *cap);
+void dmbus_capture_frame(struct dmbus_capture *cap, uint32_t client,
+                         unsigned int kind, const void *data, size_t len);
+void dmbus_capture_flush(struct dmbus_capture *cap);
+
+#endif /* __CAPTURE_H__ */
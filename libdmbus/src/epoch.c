@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Epoch based reclamation, see epoch.h.
+ *
+ * Each reader thread owns a record, in which it publishes the global epoch
+ * it observed on entering a section. The global epoch only moves on once
+ * every reader in a section has observed its current value, so an object
+ * unlinked and retired during epoch e cannot be reached by anyone when the
+ * global epoch is e + 2. Entering and leaving a section never waits, only
+ * the reclaimer, under epoch_lock, looks at the other threads.
+ */
+
+#include "project.h"
+#include "epoch.h"
+
+/* Retired during epochs e, e - 1, and e - 2 about to be released */
+#define EPOCH_LISTS 3
+
+#define EPOCH_ACTIVE 1UL
+#define EPOCH_MASK (ULONG_MAX >> 1)
+
+struct epoch_record
+{
+    struct epoch_record *next; /* Never freed, reused once the thread exits */
+    unsigned long state;       /* Observed epoch << 1 | EPOCH_ACTIVE */
+    unsigned int nesting;
+    int in_use;
+};
+
+static struct epoch_record *records = NULL;
+static unsigned long global_epoch = 0;
+
+/* Readers that could not get a record hold back reclamation altogether */
+static unsigned int stalled = 0;
+
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dmbus_epoch_entry *limbo[EPOCH_LISTS];
+static unsigned int limbo_count = 0;
+
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static __thread struct epoch_record *self;
+static __thread unsigned int stalled_nesting;
+
+static void record_put(void *arg)
+{
+    struct epoch_record *r = arg;
+
+    store_release(&r->in_use, 0);
+}
+
+static void record_key_create(void)
+{
+    pthread_key_create(&record_key, record_put);
+}
+
+static struct epoch_record *record_get(void)
+{
+    struct epoch_record *r;
+    int unused;
+
+    if (self)
+        return self;
+
+    pthread_once(&record_once, record_key_create);
+
+    /* Take over the record of a thread that exited */
+    for (r = load_acquire(&records); r; r = r->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto found;
+    }
+
+    r = calloc(1, sizeof (*r));
+    if (!r)
+        return NULL;
+    r->in_use = 1;
+
+    pthread_mutex_lock(&epoch_lock);
+    r->next = records;
+    store_release(&records, r);
+    pthread_mutex_unlock(&epoch_lock);
+
+found:
+    pthread_setspecific(record_key, r);
+    self = r;
+
+    return r;
+}
+
+void dmbus_epoch_enter(void)
+{
+    struct epoch_record *r;
+
+    if (!stalled_nesting) {
+        r = record_get();
+        if (r) {
+            if (r->nesting++)
+                return;
+            __atomic_store_n(&r->state,
+                             (load_acquire(&global_epoch) << 1) | EPOCH_ACTIVE,
+                             __ATOMIC_RELAXED);
+            /* Published before anything shared is read */
+            full_barrier();
+            return;
+        }
+    }
+
+    if (!stalled_nesting++)
+        __atomic_fetch_add(&stalled, 1, __ATOMIC_SEQ_CST);
+}
+
+void dmbus_epoch_exit(void)
+{
+    if (stalled_nesting) {
+        if (!--stalled_nesting)
+            __atomic_fetch_sub(&stalled, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (!--self->nesting)
+        store_release(&self->state, 0);
+}
+
+void dmbus_epoch_retire(struct dmbus_epoch_entry *e,
+                        void (*release)(struct dmbus_epoch_entry *e))
+{
+    struct dmbus_epoch_entry **list;
+
+    e->release = release;
+
+    pthread_mutex_lock(&epoch_lock);
+    list = &limbo[global_epoch % EPOCH_LISTS];
+    e->next = *list;
+    *list = e;
+    store_release(&limbo_count, limbo_count + 1);
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+/* Move the global epoch on if every reader has caught up, epoch_lock held */
+static int epoch_advance(void)
+{
+    struct epoch_record *r;
+    unsigned long state;
+
+    /* Pairs with the barrier in dmbus_epoch_enter() */
+    full_barrier();
+
+    if (load_acquire(&stalled))
+        return 0;
+
+    for (r = records; r; r = r->next) {
+        state = load_acquire(&r->state);
+        if ((state & EPOCH_ACTIVE) &&
+            (state >> 1) != (global_epoch & EPOCH_MASK))
+            return 0;
+    }
+
+    store_release(&global_epoch, global_epoch + 1);
+
+    return 1;
+}
+
+void dmbus_epoch_reclaim(void)
+{
+    struct dmbus_epoch_entry *e, *done = NULL, **tail = &done;
+    struct dmbus_epoch_entry **list;
+    unsigned int n;
+    int i;
+
+    if (!load_acquire(&limbo_count))
+        return;
+
+    pthread_mutex_lock(&epoch_lock);
+
+    /* Two steps are enough for everything retired before this call */
+    for (i = 0; i < EPOCH_LISTS - 1 && limbo_count; i++) {
+        if (!epoch_advance())
+            break;
+
+        list = &limbo[(global_epoch + 1) % EPOCH_LISTS];
+        for (n = 0, *tail = *list; *tail; tail = &(*tail)->next)
+            n++;
+        *list = NULL;
+        store_release(&limbo_count, limbo_count - n);
+    }
+
+    pthread_mutex_unlock(&epoch_lock);
+
+    /* Release functions may retire, or free, whatever they like */
+    while ((e = done)) {
+        done = e->next;
+        e->release(e);
+    }
+}
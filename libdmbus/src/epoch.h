@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __EPOCH_H__
+# define __EPOCH_H__
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers walk shared lists between dmbus_epoch_enter() and
+ * dmbus_epoch_exit(), without taking any lock; sections nest. Writers
+ * unlink objects under their own lock and hand them to
+ * dmbus_epoch_retire(): the release function runs from a later
+ * dmbus_epoch_reclaim(), once every reader that could still see the
+ * object has left its section.
+ */
+struct dmbus_epoch_entry
+{
+    struct dmbus_epoch_entry *next;
+    void (*release)(struct dmbus_epoch_entry *e);
+};
+
+void dmbus_epoch_enter(void);
+void dmbus_epoch_exit(void);
+void dmbus_epoch_retire(struct dmbus_epoch_entry *e,
+                        void (*release)(struct dmbus_epoch_entry *e));
+void dmbus_epoch_reclaim(void);
+
+#endif /* __EPOCH_H__ */
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Fragmentation and reassembly of large messages, see frag.h.
+ */
+
+#include "project.h"
+#include "frag.h"
+
+/* Length of the train carrying a message of len bytes */
+size_t dmbus_frag_train_len(size_t len)
+{
+    size_t body = len - sizeof (struct dmbus_msg_hdr);
+    size_t frames = (body + DMBUS_FRAG_PAYLOAD - 1) / DMBUS_FRAG_PAYLOAD;
+
+    return len + (frames - 1) * sizeof (struct dmbus_msg_hdr);
+}
+
+/*
+ * Cut msg, with its header filled in, into train, which must hold
+ * dmbus_frag_train_len(len) bytes. Returns the length of the train.
+ */
+size_t dmbus_frag_split(const void *msg, size_t len, void *train)
+{
+    const struct dmbus_msg_hdr *hdr = msg;
+    const uint8_t *body = (const uint8_t *)(hdr + 1);
+    size_t left = len - sizeof (*hdr);
+    uint8_t *p = train;
+    struct dmbus_msg_hdr *f;
+    size_t n;
+
+    while (left) {
+        n = left < DMBUS_FRAG_PAYLOAD ? left : DMBUS_FRAG_PAYLOAD;
+        left -= n;
+
+        f = (struct dmbus_msg_hdr *)p;
+        f->msg_len = sizeof (*f) + n;
+        f->msg_type = hdr->msg_type | (left ? DMBUS_MSG_MORE : 0);
+        f->return_value = hdr->return_value;
+        memcpy(f + 1, body, n);
+
+        body += n;
+        p += f->msg_len;
+    }
+
+    return p - (uint8_t *)train;
+}
+
+/*
+ * Add a frame to the message being reassembled. Returns the length of the
+ * message once it is complete in r->buf, where it stays until the next
+ * frame is added, 0 while more frames are expected, or -1 with errno set
+ * if the frame does not belong there, dropping what was gathered.
+ */
+ssize_t dmbus_frag_add(struct dmbus_reasm *r, const void *frame, size_t len)
+{
+    const struct dmbus_msg_hdr *f = frame;
+    struct dmbus_msg_hdr *hdr;
+    size_t n = len - sizeof (*f);
+
+    if (!r->len) {
+        /* A train has at least two frames, and starts with a full one */
+        if (!(f->msg_type & DMBUS_MSG_MORE) || len != DMBUS_MAX_MSG_LEN)
+            goto proto;
+        if (!r->buf) {
+            r->buf = malloc(DMBUS_MAX_LARGE_MSG_LEN);
+            if (!r->buf)
+                return -1;
+        }
+        memcpy(r->buf, frame, len);
+        r->len = len;
+        return 0;
+    }
+
+    hdr = (struct dmbus_msg_hdr *)r->buf;
+    if ((f->msg_type | DMBUS_MSG_MORE) != hdr->msg_type ||
+        n > DMBUS_MAX_LARGE_MSG_LEN - r->len)
+        goto proto;
+    if ((f->msg_type & DMBUS_MSG_MORE) && len != DMBUS_MAX_MSG_LEN)
+        goto proto;
+
+    memcpy(r->buf + r->len, f + 1, n);
+    r->len += n;
+    if (f->msg_type & DMBUS_MSG_MORE)
+        return 0;
+
+    hdr->msg_type &= ~DMBUS_MSG_MORE;
+    hdr->msg_len = r->len;
+    r->len = 0;
+
+    return hdr->msg_len;
+
+proto:
+    r->len = 0;
+    errno = EPROTO;
+    return -1;
+}
+
+void dmbus_frag_release(struct dmbus_reasm *r)
+{
+    free(r->buf);
+    r->buf = NULL;
+    r->len = 0;
+}
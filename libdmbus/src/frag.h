@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __FRAG_H__
+# define __FRAG_H__
+
+/*
+ * Fragmentation of messages longer than DMBUS_MAX_MSG_LEN.
+ *
+ * A large message goes out as a train of frames of at most
+ * DMBUS_MAX_MSG_LEN, back to back. Each frame has a header of its own,
+ * with the msg_type and return_value of the message, DMBUS_MSG_MORE set
+ * on all but the last one, and carries the next part of the body. The
+ * train is built in one buffer, so it can be written in one go.
+ */
+# define DMBUS_FRAG_PAYLOAD (DMBUS_MAX_MSG_LEN - sizeof (struct dmbus_msg_hdr))
+
+struct dmbus_reasm
+{
+    uint8_t *buf;   /* DMBUS_MAX_LARGE_MSG_LEN, allocated on first use */
+    size_t len;     /* 0 when no message is being reassembled */
+};
+
+size_t dmbus_frag_train_len(size_t len);
+size_t dmbus_frag_split(const void *msg, size_t len, void *train);
+ssize_t dmbus_frag_add(struct dmbus_reasm *r, const void *frame, size_t len);
+void dmbus_frag_release(struct dmbus_reasm *r);
+
+#endif /* __FRAG_H__ */
@@ -94,10 +94,22 @@
 # endif
 
 # include <limits.h>
+# include <stddef.h>
 # include <sys/ioctl.h>
+# include <sys/epoll.h>
+# include <sys/timerfd.h>
+# include <sys/eventfd.h>
+# include <poll.h>
+# include <signal.h>
+# include <linux/input.h>
 
 # include <libv4v.h>
 
 # include "libdmbus.h"
 
+/* Memory shared with other threads, or other processes */
+# define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define full_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 #endif /* __PROJECT_H__ */
@@ -8,6 +8,12 @@ divert(-1)
 #   comunicating ends can remain backward compatible with older
 #   versions of the library.
 #
+#   DEFINE_VARIABLE_MESSAGE(id, name, element, format...)
+#   Define a message type with the given fixed format, followed by a
+#   variable length array of element (e.g. "InputEvent events"). The
+#   number of elements is implied by the message length, see the
+#   DMBUS_VMSG_* helpers in libdmbus.h.
+#
 #   DEFINE_IN_RPC_NO_RETURN(in_message_type)
 #   Define an asynchronous, inbound (dm to service) RPC using
 #   in_message_type as a previously defined input message type.
@@ -16,17 +22,21 @@ divert(-1)
 #   DEFINE_IN_RPC_WITH_RETURN(in_message_type, out_message_type)
 #   Define a synchronous, inbound (dm to service) RPC using
 #   in_message_type as a previously defined input message type.
-#   The caller expects a reply of the out_message_type message type.
+#   The caller expects a reply of the out_message_type message type,
+#   which <name>_call() delivers asynchronously on the device model side.
 #
 #   DEFINE_OUT_RPC(out_message_type)
 #   Define an asynchronous, outbound (service to dm) RPC using
 #   out_message_type as a previously defined output message type.
-#   The RPC is directed to a unique connected client.
+#   The RPC is directed to a unique connected client, or with
+#   <name>_to_domain() to the clients of a domain with a given device
+#   type, looked up in an index.
 #
 #   DEFINE_BROADCAST_RPC(out_message_type)
 #   Define an asynchronous, outbound (service to dm) RPC using
 #   out_message_type as a previously defined output message type.
-#   The RPC is broadcasted to all connected clients.
+#   The RPC is broadcasted to all connected clients, of the service
+#   created by dmbus_init(), or of the given one with <name>_broadcast().
 #
 include(rpcgen.m4)
 
@@ -63,6 +73,7 @@ DEFINE_MESSAGE(21, dom0_input_event, uint16_t type,
 DEFINE_MESSAGE(24, input_config_reset, uint8_t slot)
 DEFINE_MESSAGE(25, input_config, InputConfig c)
 DEFINE_MESSAGE(26, input_wakeup)
+DEFINE_VARIABLE_MESSAGE(27, dom0_input_events, InputEvent events)
 
 DEFINE_IN_RPC_NO_RETURN(switcher_abs)
 DEFINE_IN_RPC_NO_RETURN(switcher_pvm_domid)
@@ -70,6 +81,7 @@ DEFINE_IN_RPC_NO_RETURN(switcher_domid)
 DEFINE_IN_RPC_NO_RETURN(switcher_leds)
 DEFINE_IN_RPC_NO_RETURN(switcher_shutdown)
 DEFINE_OUT_RPC(dom0_input_event)
+DEFINE_OUT_RPC(dom0_input_events)
 DEFINE_OUT_RPC(input_config)
 DEFINE_OUT_RPC(input_config_reset)
 DEFINE_OUT_RPC(input_wakeup)
@@ -78,4 +90,15 @@ DEFINE_OUT_RPC(input_wakeup)
 DEFINE_MESSAGE(23, device_model_ready)
 DEFINE_OUT_RPC(device_model_ready) # Indicate the service is ready to emulate the new domain
 
+# Shared memory transport negotiation, handled by libdmbus itself.
+# The offer follows the prologue, the accept (return_value 0) or refusal
+# (an errno value) is the first message from the service.
+DEFINE_MESSAGE(28, shm_offer, uint32_t version, uint32_t size)
+DEFINE_MESSAGE(29, shm_accept)
+
+# Sent by the service before anything else but shm_accept, DMBUS_CAP_*
+DEFINE_MESSAGE(30, service_caps, uint32_t caps)
+# Sent by the device model right after the prologue, DMBUS_CAP_*
+DEFINE_MESSAGE(31, dm_caps, uint32_t caps)
+
 divert(0)dnl
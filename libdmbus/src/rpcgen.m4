@@ -9,8 +9,15 @@ define(MSGSTRUCT, `struct msg_$1
 foreach(`X',`    X;
 ',shift($@))} DMBUS_PACKED $1;')
 
+define(VMSGSTRUCT, `struct msg_$1
+{
+    struct dmbus_msg_hdr hdr;
+foreach(`X',`    X;
+',shift(shift($@)))    $2[];
+} DMBUS_PACKED $1;')
 
 define(`MSG_STRUCTS',`')
+define(`MSG_NAMES',`')
 define(`SERV_MSG_OPS',`')
 define(`SERV_MSG_HANDLERS',`')
 define(`DM_RPC_FUNCS',`')
@@ -21,6 +28,16 @@ define(`DEFINE_MESSAGE', `define(`MSGID_'$2,DMBUS_MSG_`'capitalize($2))'dnl
                          `define(`MSG_STRUCTS',MSG_STRUCTS
 `#define' MSGID_$2 $1
 MSGSTRUCT(shift($@)))'dnl
+                         `define(`MSG_NAMES',defn(`MSG_NAMES')`    [$1] = "$2",
+')'dnl
+)
+
+define(`DEFINE_VARIABLE_MESSAGE', `define(`MSGID_'$2,DMBUS_MSG_`'capitalize($2))'dnl
+                         `define(`MSG_STRUCTS',MSG_STRUCTS
+`#define' MSGID_$2 $1
+VMSGSTRUCT(shift($@)))'dnl
+                         `define(`MSG_NAMES',defn(`MSG_NAMES')`    [$1] = "$2",
+')'dnl
 )
 
 define(`DEFINE_IN_RPC_NO_RETURN', `define(`SERV_MSG_OPS', SERV_MSG_OPS`'dnl
@@ -53,34 +70,61 @@ case MSGID_$1:
             ret = c->rpc_ops->$1(``c->priv, &m->''$1``, len, &out'');
         }
         out.hdr.return_value = (uint32_t) ret;
-        send_msg(``c, ''MSGID_$2``, &out, sizeof (out)'');
+        send_reply(``c, ''MSGID_$2`` | (m->hdr.msg_type & DMBUS_MSG_ID_MASK),
+                   &out, sizeof (out)'');
         break;
 }
 )'dnl
+`define(`DM_RPC_DEFS', DM_RPC_DEFS
+`int '$1`_call(dmbus_conn_t conn, struct msg_'$1` *msg, size_t msglen, dmbus_reply_cb cb, void *opaque);')'dnl
+`define(`DM_RPC_FUNCS', DM_RPC_FUNCS
+`int '$1`_call(dmbus_conn_t conn, struct msg_'$1` *msg, size_t msglen, dmbus_reply_cb cb, void *opaque)'
+{
+    return conn_call(conn, MSGID_$1, MSGID_$2, msg, msglen, cb, opaque);
+}
+)'dnl
 )
 
 define(`DEFINE_OUT_RPC', `define(`DM_RPC_DEFS', DM_RPC_DEFS
-`void '$1`(dmbus_client_t client, struct msg_'$1` *msg, size_t msglen);')'dnl
+`int '$1`(dmbus_client_t client, struct msg_'$1` *msg, size_t msglen);'
+`int '$1`_to_domain(dmbus_service_t service, int domain, DeviceType type, struct msg_'$1` *msg, size_t msglen);')'dnl
                         `define(`DM_RPC_FUNCS', DM_RPC_FUNCS
-`void '$1`(dmbus_client_t client, struct msg_'$1` *msg, size_t msglen)'
+`int '$1`(dmbus_client_t client, struct msg_'$1` *msg, size_t msglen)'
 {
     struct dmbus_client *c = client;
 
-    send_msg(c, MSGID_$1, msg, msglen);
+    return send_msg(c, MSGID_$1, msg, msglen);
+}
+
+`int '$1`_to_domain(dmbus_service_t service, int domain, DeviceType type, struct msg_'$1` *msg, size_t msglen)'
+{
+    return send_to_domain(service, domain, type, MSGID_$1, msg, msglen);
 }
 )'dnl
 )
 
 define(`DEFINE_BROADCAST_RPC', `define(`DM_RPC_DEFS', DM_RPC_DEFS
-`void '$1`(struct msg_'$1` *msg, size_t msglen);')'dnl
+`int '$1`(struct msg_'$1` *msg, size_t msglen);'
+`int '$1`_broadcast(dmbus_service_t service, struct msg_'$1` *msg, size_t msglen);')'dnl
                         `define(`DM_RPC_FUNCS', DM_RPC_FUNCS
-`void '$1`(struct msg_'$1` *msg, size_t msglen)'
+`int '$1`(struct msg_'$1` *msg, size_t msglen)'
 {
-    broadcast_msg(MSGID_$1, msg, msglen);
+    return broadcast_msg(default_service, MSGID_$1, msg, msglen);
+}
+
+`int '$1`_broadcast(dmbus_service_t service, struct msg_'$1` *msg, size_t msglen)'
+{
+    return broadcast_msg(service, MSGID_$1, msg, msglen);
 }
 )'dnl
 )
 
+dnl HASH_BYTES(hex): the bytes of a hex string, as an array initializer body
+define(`HASH_BYTES', `ifelse(`$1', `', `', `0x`'substr(`$1', 0, 2)`'ifelse(len(`$1'), 2, `', `, HASH_BYTES(substr(`$1', 2))')')')
+
+define(`SHA1_HEX', substr(include(dmbus.sha1), 0, 40))
+
 define(`INTERFACE_HASH',dnl
-`# define DMBUS_SHA1_STRING "'substr(include(dmbus.sha1), 0, 40)`"'dnl
+``# define DMBUS_SHA1_STRING "'SHA1_HEX`"
+# define DMBUS_SHA1_BYTES { 'HASH_BYTES(SHA1_HEX)` }''dnl
 )
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Shared memory rings, see shm.h.
+ *
+ * The peer is not trusted: its cursor is checked on every access, and
+ * messages are copied out of the ring before they are looked at, so they
+ * cannot change under the handler's feet.
+ */
+
+#define _GNU_SOURCE /* memfd_create(), F_ADD_SEALS */
+#include "project.h"
+#include "shm.h"
+
+#define SHM_RING_IDX(i) ((i) & (DMBUS_SHM_RING_SIZE - 1))
+
+struct dmbus_shm *dmbus_shm_create(int *memfd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    struct dmbus_shm *shm;
+    int fd, err;
+
+    fd = memfd_create("dmbus", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+        return NULL;
+
+    /* The service refuses memory that could shrink under it */
+    if (ftruncate(fd, sizeof (*shm)) == -1 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        goto fail;
+
+    shm = mmap(NULL, sizeof (*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+        goto fail;
+
+    /* Both consumers start idle, waiting for the first message */
+    shm->to_service.cons_waiting = 1;
+    shm->to_dm.cons_waiting = 1;
+
+    *memfd = fd;
+    return shm;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+struct dmbus_shm *dmbus_shm_map(int memfd)
+{
+#ifdef HAVE_MEMFD_CREATE
+    struct dmbus_shm *shm;
+    struct stat st;
+    int seals;
+
+    seals = fcntl(memfd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &st) == -1) {
+        errno = EPERM;
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof (*shm)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    shm = mmap(NULL, sizeof (*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+               memfd, 0);
+
+    return shm == MAP_FAILED ? NULL : shm;
+#else
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+void dmbus_shm_unmap(struct dmbus_shm *shm)
+{
+    munmap(shm, sizeof (*shm));
+}
+
+static void ring_kick(int kick)
+{
+    uint64_t one = 1;
+
+    /* The counter saturating means a wakeup is pending anyway */
+    if (write(kick, &one, sizeof (one)) == -1)
+        return;
+}
+
+size_t dmbus_ring_pending(struct dmbus_shm_ring *r)
+{
+    return (uint32_t)(load_acquire(&r->prod) - r->cons);
+}
+
+static void ring_copy_in(struct dmbus_shm_ring *r, uint32_t pos,
+                         const void *src, size_t len)
+{
+    size_t off = SHM_RING_IDX(pos);
+    size_t contig = DMBUS_SHM_RING_SIZE - off;
+
+    if (len <= contig) {
+        memcpy(r->data + off, src, len);
+    } else {
+        memcpy(r->data + off, src, contig);
+        memcpy(r->data, (const uint8_t *)src + contig, len - contig);
+    }
+}
+
+static void ring_copy_out(struct dmbus_shm_ring *r, uint32_t pos,
+                          void *dst, size_t len)
+{
+    size_t off = SHM_RING_IDX(pos);
+    size_t contig = DMBUS_SHM_RING_SIZE - off;
+
+    if (len <= contig) {
+        memcpy(dst, r->data + off, len);
+    } else {
+        memcpy(dst, r->data + off, contig);
+        memcpy((uint8_t *)dst + contig, r->data, len - contig);
+    }
+}
+
+/*
+ * Append a message, the consumer only learns about it with
+ * dmbus_ring_notify(), so a burst costs a single doorbell.
+ * Returns -1 with errno EAGAIN if the ring is full, in which case the
+ * consumer will ring back once it has made room.
+ */
+int dmbus_ring_write(struct dmbus_shm_ring *r, const void *msg, size_t len)
+{
+    uint32_t prod = r->prod;
+    uint32_t used;
+
+    used = prod - load_acquire(&r->cons);
+    if (used > DMBUS_SHM_RING_SIZE) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (DMBUS_SHM_RING_SIZE - used < len) {
+        r->prod_waiting = 1;
+        full_barrier();
+        used = prod - load_acquire(&r->cons);
+        if (used > DMBUS_SHM_RING_SIZE || DMBUS_SHM_RING_SIZE - used < len) {
+            errno = used > DMBUS_SHM_RING_SIZE ? EPROTO : EAGAIN;
+            return -1;
+        }
+        r->prod_waiting = 0;
+    }
+
+    ring_copy_in(r, prod, msg, len);
+    store_release(&r->prod, prod + len);
+
+    return 0;
+}
+
+/* Ring kick if the consumer went idle before seeing what was written */
+void dmbus_ring_notify(struct dmbus_shm_ring *r, int kick)
+{
+    full_barrier();
+    if (r->cons_waiting) {
+        r->cons_waiting = 0;
+        ring_kick(kick);
+    }
+}
+
+/*
+ * Copy the next message out of the ring into buf, and ring kick if the
+ * producer is waiting for room. Returns the message length, 0 if the ring
+ * is empty, in which case the producer will ring when it writes again, or
+ * -1 with errno EPROTO if the producer wrote something inconsistent.
+ */
+ssize_t dmbus_ring_read(struct dmbus_shm_ring *r, int kick,
+                        void *buf, size_t len)
+{
+    struct dmbus_msg_hdr hdr;
+    uint32_t cons = r->cons;
+    uint32_t avail;
+
+    avail = load_acquire(&r->prod) - cons;
+    if (!avail) {
+        r->cons_waiting = 1;
+        full_barrier();
+        avail = load_acquire(&r->prod) - cons;
+        if (!avail)
+            return 0;
+        r->cons_waiting = 0;
+    }
+
+    if (avail > DMBUS_SHM_RING_SIZE || avail < sizeof (hdr))
+        goto bad;
+
+    /* Whole messages are published at once, the header has to fit */
+    ring_copy_out(r, cons, &hdr, sizeof (hdr));
+    if (hdr.msg_len < sizeof (hdr) || hdr.msg_len > DMBUS_MAX_MSG_LEN ||
+        hdr.msg_len > avail)
+        goto bad;
+    if (hdr.msg_len > len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    ring_copy_out(r, cons, buf, hdr.msg_len);
+    /* The header is the one that was checked, whatever the ring says now */
+    memcpy(buf, &hdr, sizeof (hdr));
+    store_release(&r->cons, cons + hdr.msg_len);
+
+    full_barrier();
+    if (r->prod_waiting) {
+        r->prod_waiting = 0;
+        ring_kick(kick);
+    }
+
+    return hdr.msg_len;
+
+bad:
+    errno = EPROTO;
+    return -1;
+}
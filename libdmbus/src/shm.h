@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __SHM_H__
+# define __SHM_H__
+
+/*
+ * Shared memory transport.
+ *
+ * The device model creates the memory and two eventfd doorbells, and
+ * passes them along with its connection prologue, followed by a shm_offer
+ * message. The service answers with shm_accept before anything else, from
+ * then on messages flow through the rings in both directions, in the same
+ * format as on the socket. The socket stays open to detect disconnection.
+ */
+# define DMBUS_SHM_VERSION 1
+
+/* Must be a power of two, so the free running cursors can wrap */
+# define DMBUS_SHM_RING_SIZE (128 * DMBUS_MAX_MSG_LEN)
+
+/* Passed with the prologue: memory, service doorbell, device model doorbell */
+# define DMBUS_SHM_NFDS 3
+
+# define DMBUS_CACHELINE 64
+
+/*
+ * Single producer, single consumer ring. Each side only writes its own
+ * cursor. A side finding the ring full (producer) or empty (consumer)
+ * raises its waiting flag, and the other end rings its doorbell when it
+ * next moves its cursor.
+ */
+struct dmbus_shm_ring
+{
+    uint32_t prod;
+    uint32_t prod_waiting;
+    uint8_t pad0[DMBUS_CACHELINE - 2 * sizeof (uint32_t)];
+    uint32_t cons;
+    uint32_t cons_waiting;
+    uint8_t pad1[DMBUS_CACHELINE - 2 * sizeof (uint32_t)];
+    uint8_t data[DMBUS_SHM_RING_SIZE];
+};
+
+struct dmbus_shm
+{
+    struct dmbus_shm_ring to_service;
+    struct dmbus_shm_ring to_dm;
+};
+
+struct dmbus_shm *dmbus_shm_create(int *memfd);
+struct dmbus_shm *dmbus_shm_map(int memfd);
+void dmbus_shm_unmap(struct dmbus_shm *shm);
+
+int dmbus_ring_write(struct dmbus_shm_ring *r, const void *msg, size_t len);
+void dmbus_ring_notify(struct dmbus_shm_ring *r, int kick);
+ssize_t dmbus_ring_read(struct dmbus_shm_ring *r, int kick,
+                        void *buf, size_t len);
+size_t dmbus_ring_pending(struct dmbus_shm_ring *r);
+
+#endif /* __SHM_H__ */
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Message statistics, see stats.h.
+ *
+ * Only the owner of a shard writes to it, with plain relaxed stores, so a
+ * reader may see a message counted but not its time yet, never a torn
+ * counter.
+ */
+
+#include "project.h"
+#include "stats.h"
+
+#ifdef __x86_64__
+# include <cpuid.h>
+#endif
+
+struct stats_shard
+{
+    struct stats_shard *next;  /* Never freed, reused once the thread exits */
+    int in_use;
+    struct dmbus_stats stats;
+};
+
+int dmbus_stats_enabled = 1;
+
+static struct stats_shard *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static __thread struct stats_shard *self;
+
+uint64_t dmbus_tsc_mult = 0;
+uint64_t dmbus_tsc_base = 0;
+uint64_t dmbus_tsc_base_ns = 0;
+
+/* Long enough for the clock read jitter not to matter */
+#define TSC_CALIBRATION_NS 10000000ULL
+
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tsc_usable = -1;
+
+#define STAT_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+static void shard_put(void *arg)
+{
+    struct stats_shard *sh = arg;
+
+    store_release(&sh->in_use, 0);
+}
+
+static void shard_key_create(void)
+{
+    pthread_key_create(&shard_key, shard_put);
+}
+
+static struct stats_shard *shard_get(void)
+{
+    struct stats_shard *sh;
+    int unused;
+
+    pthread_once(&shard_once, shard_key_create);
+
+    for (sh = load_acquire(&shards); sh; sh = sh->next) {
+        unused = 0;
+        if (__atomic_compare_exchange_n(&sh->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto found;
+    }
+
+    sh = calloc(1, sizeof (*sh));
+    if (!sh)
+        return NULL;
+    sh->in_use = 1;
+
+    pthread_mutex_lock(&shards_lock);
+    sh->next = shards;
+    store_release(&shards, sh);
+    pthread_mutex_unlock(&shards_lock);
+
+found:
+    pthread_setspecific(shard_key, sh);
+    self = sh;
+
+    return sh;
+}
+
+static int tsc_invariant(void)
+{
+#ifdef __x86_64__
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) &&
+        eax >= 0x80000007 &&
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return !!(edx & (1 << 8));
+#endif
+    return 0;
+}
+
+/*
+ * CLOCK_MONOTONIC, which also calibrates the TSC: the first reading sets
+ * a base, the first one TSC_CALIBRATION_NS later gives the tick rate, and
+ * dmbus_stats_now() switches to the TSC from then on.
+ */
+uint64_t dmbus_stats_clock(void)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+#ifdef __x86_64__
+    if (!tsc_usable || pthread_mutex_trylock(&calibration_lock))
+        return ns;
+
+    if (tsc_usable == -1)
+        tsc_usable = tsc_invariant();
+    if (tsc_usable && !dmbus_tsc_mult) {
+        uint64_t tsc = __builtin_ia32_rdtsc();
+
+        if (!dmbus_tsc_base_ns) {
+            dmbus_tsc_base = tsc;
+            dmbus_tsc_base_ns = ns;
+        } else if (ns - dmbus_tsc_base_ns >= TSC_CALIBRATION_NS &&
+                   tsc > dmbus_tsc_base) {
+            store_release(&dmbus_tsc_mult, ((ns - dmbus_tsc_base_ns) << 32) /
+                          (tsc - dmbus_tsc_base));
+        }
+    }
+
+    pthread_mutex_unlock(&calibration_lock);
+#endif
+
+    return ns;
+}
+
+/* Bucket i holds [2^i, 2^(i + 1)) nanoseconds, the last one the rest */
+static inline unsigned int bucket(uint64_t ns)
+{
+    unsigned int b = 63 - __builtin_clzll(ns | 1);
+
+    return b < DMBUS_STATS_BUCKETS ? b : DMBUS_STATS_BUCKETS - 1;
+}
+
+void dmbus_stats_record(unsigned int type, size_t len, uint64_t queue_ns,
+                        uint64_t handler_ns)
+{
+    struct stats_shard *sh = self;
+    struct dmbus_msg_stats *st;
+
+    if (type >= DMBUS_STATS_MAX_TYPE)
+        return;
+    if (!sh && !(sh = shard_get()))
+        return;
+
+    st = &sh->stats.type[type];
+    STAT_ADD(st->count, 1);
+    STAT_ADD(st->bytes, len);
+    STAT_ADD(st->queue_ns, queue_ns);
+    STAT_ADD(st->handler_ns, handler_ns);
+    STAT_ADD(st->queue_hist[bucket(queue_ns)], 1);
+    STAT_ADD(st->handler_hist[bucket(handler_ns)], 1);
+}
+
+void dmbus_stats_read(struct dmbus_stats *stats)
+{
+    struct stats_shard *sh;
+    uint64_t *dst, *src;
+    size_t i;
+
+    memset(stats, 0, sizeof (*stats));
+
+    /* Every field is a uint64_t counter */
+    for (sh = load_acquire(&shards); sh; sh = sh->next) {
+        dst = (uint64_t *)stats;
+        src = (uint64_t *)&sh->stats;
+        for (i = 0; i < sizeof (*stats) / sizeof (uint64_t); i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Upper bound of the bucket holding the pct-th percentile */
+uint64_t dmbus_stats_percentile(const uint64_t *hist, uint64_t count,
+                                unsigned int pct)
+{
+    uint64_t target = (count * pct + 99) / 100;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < DMBUS_STATS_BUCKETS - 1; i++) {
+        seen += hist[i];
+        if (seen >= target)
+            break;
+    }
+
+    return (2ULL << i) - 1;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __STATS_H__
+# define __STATS_H__
+
+/*
+ * Message statistics.
+ *
+ * Each thread that dispatches messages counts into a shard of its own, so
+ * recording takes no lock and writes no shared cache line. Readers add the
+ * shards up. A shard outlives its thread, and is handed to the next thread
+ * that needs one, counts included.
+ */
+extern int dmbus_stats_enabled;
+
+/*
+ * Timestamps, in ns. A clock_gettime() costs more than recording a message,
+ * so where the TSC is invariant it is used instead, once it has been
+ * calibrated against CLOCK_MONOTONIC during the first few milliseconds.
+ */
+extern uint64_t dmbus_tsc_mult; /* ns per tick << 32, 0 until calibrated */
+extern uint64_t dmbus_tsc_base;
+extern uint64_t dmbus_tsc_base_ns;
+
+uint64_t dmbus_stats_clock(void);
+
+static inline uint64_t dmbus_stats_now(void)
+{
+#ifdef __x86_64__
+    uint64_t mult = load_acquire(&dmbus_tsc_mult);
+
+    if (mult)
+        return dmbus_tsc_base_ns +
+            (uint64_t)(((unsigned __int128)(__builtin_ia32_rdtsc() -
+                                            dmbus_tsc_base) * mult) >> 32);
+#endif
+    return dmbus_stats_clock();
+}
+
+/*
+ * Time from one stamp to a later one. Stamps taken either side of the
+ * switch to the TSC can come out of order by a little, which is not worth
+ * counting as a latency of centuries.
+ */
+static inline uint64_t dmbus_stats_elapsed(uint64_t from, uint64_t to)
+{
+    return to > from ? to - from : 0;
+}
+
+void dmbus_stats_record(unsigned int type, size_t len, uint64_t queue_ns,
+                        uint64_t handler_ns);
+void dmbus_stats_read(struct dmbus_stats *stats);
+uint64_t dmbus_stats_percentile(const uint64_t *hist, uint64_t count,
+                                unsigned int pct);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * dmbus transports.
+ *
+ * v4v is what runs on a Xen host. The UNIX domain transport serves the
+ * same protocol on an abstract socket ("\0dmbus-<service id>"), so
+ * services can be exercised and benchmarked without a hypervisor. It can
+ * also pass file descriptors, which the shared memory transport needs.
+ */
+
+#define _GNU_SOURCE /* accept4(), MSG_CMSG_CLOEXEC */
+#include "project.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* v4v */
+
+static int v4v_transport_listen(int service_id)
+{
+    v4v_addr_t addr;
+    int fd;
+
+    fd = v4v_socket(SOCK_STREAM);
+    if (fd == -1)
+        return -1;
+
+    addr.port = DMBUS_BASE_PORT + service_id;
+    addr.domain = V4V_DOMID_ANY;
+
+    if (v4v_bind(fd, &addr, V4V_DOMID_ANY) == -1 ||
+        v4v_listen(fd, 128) == -1) {
+        v4v_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int v4v_transport_accept(int fd, int *peer_domain)
+{
+    v4v_addr_t addr;
+    int rc;
+
+    rc = v4v_accept(fd, &addr);
+    if (rc != -1)
+        *peer_domain = addr.domain;
+
+    return rc;
+}
+
+static int v4v_transport_connect(int service_id, int domain)
+{
+    v4v_addr_t addr;
+    int fd;
+
+    fd = v4v_socket(SOCK_STREAM);
+    if (fd == -1)
+        return -1;
+
+    addr.port = DMBUS_BASE_PORT + service_id;
+    addr.domain = domain;
+
+    if (v4v_connect(fd, &addr) == -1) {
+        v4v_close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static ssize_t v4v_transport_send(int fd, const void *buf, size_t len,
+                                  int flags)
+{
+    return v4v_send(fd, buf, len, flags);
+}
+
+static ssize_t v4v_transport_recv(int fd, void *buf, size_t len, int flags)
+{
+    return v4v_recv(fd, buf, len, flags);
+}
+
+const struct dmbus_transport dmbus_transport_v4v = {
+    .name = "v4v",
+    .listen = v4v_transport_listen,
+    .accept = v4v_transport_accept,
+    .connect = v4v_transport_connect,
+    .send = v4v_transport_send,
+    .recv = v4v_transport_recv,
+    .close = v4v_close,
+};
+
+/* UNIX domain sockets */
+
+static socklen_t unix_transport_addr(struct sockaddr_un *un, int service_id)
+{
+    int len;
+
+    memset(un, 0, sizeof (*un));
+    un->sun_family = AF_UNIX;
+
+    /* Abstract namespace, nothing to clean up in the filesystem */
+    len = snprintf(un->sun_path + 1, sizeof (un->sun_path) - 1,
+                   DMBUS_UNIX_NAME_FMT, service_id);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int unix_transport_listen(int service_id)
+{
+    struct sockaddr_un un;
+    socklen_t len;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    len = unix_transport_addr(&un, service_id);
+    if (bind(fd, (struct sockaddr *)&un, len) == -1 ||
+        listen(fd, 128) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int unix_transport_accept(int fd, int *peer_domain)
+{
+    int rc;
+
+    rc = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (rc != -1)
+        *peer_domain = 0; /* Local peer */
+
+    return rc;
+}
+
+static int unix_transport_connect(int service_id, int domain)
+{
+    struct sockaddr_un un;
+    socklen_t len;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    len = unix_transport_addr(&un, service_id);
+    if (connect(fd, (struct sockaddr *)&un, len) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static ssize_t unix_transport_send_fds(int fd, const void *buf, size_t len,
+                                       int flags, const int *fds, int nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * DMBUS_MAX_PASSED_FDS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    if (nfds <= 0 || nfds > DMBUS_MAX_PASSED_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof (int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * nfds);
+
+    return sendmsg(fd, &msg, flags);
+}
+
+/* *nfds is the room in fds on the way in, the number received on the way out */
+static ssize_t unix_transport_recv_fds(int fd, void *buf, size_t len,
+                                       int flags, int *fds, int *nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * DMBUS_MAX_PASSED_FDS)];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    ssize_t rc;
+    int room = *nfds;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+
+    *nfds = 0;
+    rc = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (rc <= 0)
+        return rc;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        int *p = (int *)CMSG_DATA(cmsg);
+        int i, n;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+        for (i = 0; i < n; i++) {
+            if (*nfds < room)
+                fds[(*nfds)++] = p[i];
+            else
+                close(p[i]); /* More than we asked for */
+        }
+    }
+
+    return rc;
+}
+
+const struct dmbus_transport dmbus_transport_unix = {
+    .name = "unix",
+    .listen = unix_transport_listen,
+    .accept = unix_transport_accept,
+    .connect = unix_transport_connect,
+    .send = send,
+    .recv = recv,
+    .close = close,
+    .send_fds = unix_transport_send_fds,
+    .recv_fds = unix_transport_recv_fds,
+};